@@ -31,8 +31,8 @@ def run_case(case):
     result = subprocess.run(['./benchmark', *map(str, case)], capture_output=True, check=True)
     labeled, input_bits, sender_size, receiver_size, poly_modulus_degree, partition_count, window_size, iteration_count = case
     lines = [x for x in result.stdout.decode().split('\n') if (len(x) > 0)]
-    # the last element of the tuple is (matches / receiver_size)
-    runs = [(float(x[0]), float(x[1]), float(x[2]), int(x[3]) / case[3])
+    # the fourth element of the tuple is (matches / receiver_size)
+    runs = [(float(x[0]), float(x[1]), float(x[2]), int(x[3]) / case[3], float(x[4]), int(x[5]), int(x[6]) / 2**20, int(x[7]) / 2**20)
             for x in (y.split('\t') for y in lines)]
 
     print('{it} runs of {la} N_x={nx}, N_y={ny} with SEAL{pmd}, alpha={al}, l={l}:'.format(
@@ -49,13 +49,17 @@ def run_case(case):
     def stddev(l):
         l_avg = avg(l)
         return math.sqrt(sum((x - l_avg)**2 for x in l) / (len(l) - 1))
+    # nearest-rank percentile
+    def percentile(l, p):
+        return sorted(l)[max(0, math.ceil(p / 100 * len(l)) - 1)]
 
-    for (index, name) in enumerate(['sender, s', 'receiver enc, s', 'receiver dec, s', 'matches, %']):
+    for (index, name) in enumerate(['sender, s', 'receiver enc, s', 'receiver dec, s', 'matches, %', 'sender db, s', 'seed retries', 'upload, MiB', 'download, MiB']):
         values = [x[index] for x in runs]
-        print('{name}: avg {avg:.2f}, stddev {stddev:.2f}, min {min:.2f}, max {max:.2f}'.format(
+        print('{name}: avg {avg:.2f}, stddev {stddev:.2f}, p99 {p99:.2f}, min {min:.2f}, max {max:.2f}'.format(
             name=name,
             avg=avg(values),
             stddev=stddev(values),
+            p99=percentile(values, 99),
             min=min(values),
             max=max(values)
         ))
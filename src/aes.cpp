@@ -46,3 +46,61 @@ pair<uint64_t, uint64_t> AES::encrypt(uint64_t block_high, uint64_t block_low)
 
     return make_pair(result[1], result[0]);
 }
+
+void AES::encrypt_blocks(const __m128i *plaintexts, __m128i *ciphertexts, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__VAES__) && defined(__AVX512F__)
+    __m512i wide_round_key[11];
+    for (size_t r = 0; r < 11; r++) {
+        wide_round_key[r] = _mm512_broadcast_i32x4(round_key[r]);
+    }
+
+    for (; i + 16 <= count; i += 16) {
+        __m512i blocks[4];
+        #pragma GCC unroll 4
+        for (size_t k = 0; k < 4; k++) {
+            blocks[k] = _mm512_loadu_si512((const void*) &plaintexts[i + 4 * k]);
+            blocks[k] = _mm512_xor_si512(blocks[k], wide_round_key[0]);
+        }
+        for (size_t r = 1; r < 10; r++) {
+            #pragma GCC unroll 4
+            for (size_t k = 0; k < 4; k++) {
+                blocks[k] = _mm512_aesenc_epi128(blocks[k], wide_round_key[r]);
+            }
+        }
+        #pragma GCC unroll 4
+        for (size_t k = 0; k < 4; k++) {
+            blocks[k] = _mm512_aesenclast_epi128(blocks[k], wide_round_key[10]);
+            _mm512_storeu_si512((void*) &ciphertexts[i + 4 * k], blocks[k]);
+        }
+    }
+#endif
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i blocks[8];
+        #pragma GCC unroll 8
+        for (size_t k = 0; k < 8; k++) {
+            blocks[k] = _mm_xor_si128(_mm_loadu_si128(&plaintexts[i + k]), round_key[0]);
+        }
+        for (size_t r = 1; r < 10; r++) {
+            #pragma GCC unroll 8
+            for (size_t k = 0; k < 8; k++) {
+                blocks[k] = _mm_aesenc_si128(blocks[k], round_key[r]);
+            }
+        }
+        #pragma GCC unroll 8
+        for (size_t k = 0; k < 8; k++) {
+            _mm_storeu_si128(&ciphertexts[i + k], _mm_aesenclast_si128(blocks[k], round_key[10]));
+        }
+    }
+
+    for (; i < count; i++) {
+        __m128i block = _mm_xor_si128(_mm_loadu_si128(&plaintexts[i]), round_key[0]);
+        for (size_t r = 1; r < 10; r++) {
+            block = _mm_aesenc_si128(block, round_key[r]);
+        }
+        _mm_storeu_si128(&ciphertexts[i], _mm_aesenclast_si128(block, round_key[10]));
+    }
+}
@@ -1,17 +1,55 @@
 #include <chrono>
 #include <iostream>
 #include <set>
+#include <sstream>
 #include <vector>
 
+#include "bitpacking.h"
 #include "psi.h"
 #include "random.h"
 #include "test_utils.h"
 
 using namespace std;
 
+/* the number of bytes that `object` takes up when saved, e.g. to be sent over
+   the network. */
+template <typename T>
+size_t serialized_size(T &object)
+{
+    ostringstream stream;
+    object.save(stream);
+    return stream.str().size();
+}
+
+/* the number of bytes that Networking::write_packed_ciphertexts sends for
+   `ciphertext`, not counting a few bytes of metadata. */
+size_t packed_ciphertext_size(shared_ptr<SEALContext> context, Ciphertext &ciphertext)
+{
+    auto context_data = context->context_data(ciphertext.parms_id());
+    size_t n = context_data->parms().poly_modulus_degree();
+    size_t size = 0;
+    for (auto &prime : context_data->parms().coeff_modulus()) {
+        size += ciphertext.size() * packed_size(n, prime.bit_count());
+    }
+    return size;
+}
+
+/* the number of bytes that Networking sends for the c0 of a seeded ciphertext
+   or key, with or without Networking::set_packed_polynomials. */
+size_t seeded_polynomial_size(shared_ptr<SEALContext> context, Ciphertext &ciphertext, bool packed)
+{
+    auto context_data = context->context_data(ciphertext.parms_id());
+    size_t n = context_data->parms().poly_modulus_degree();
+    size_t size = 0;
+    for (auto &prime : context_data->parms().coeff_modulus()) {
+        size += packed ? packed_size(n, prime.bit_count()) : n * sizeof(uint64_t);
+    }
+    return size;
+}
+
 int main(int argc, char** argv)
 {
-    if (argc != 9) {
+    if ((argc < 9) || (argc > 18)) {
         cout << "USAGE:" << endl;
         cout << argv[0] << " labeled" // argv[1]
                         << " inputs_bits" // argv[2]
@@ -21,6 +59,15 @@ int main(int argc, char** argv)
                         << " partition_count" // argv[6]
                         << " window_size" // argv[7]
                         << " iteration_count" // argv[8]
+                        << " [thread_count]" // argv[9]
+                        << " [ntt_evaluation]" // argv[10]
+                        << " [ps_low_degree]" // argv[11]
+                        << " [query_depth]" // argv[12]
+                        << " [relin_free]" // argv[13]
+                        << " [mask_pool]" // argv[14]
+                        << " [seeded_queries]" // argv[15]
+                        << " [seeded_keys]" // argv[16]
+                        << " [packed_ciphertexts]" // argv[17]
                         << endl;
         return 1;
     }
@@ -33,6 +80,15 @@ int main(int argc, char** argv)
     size_t partition_count = atol(argv[6]);
     size_t window_size = atol(argv[7]);
     size_t iteration_count = atol(argv[8]);
+    size_t thread_count = (argc > 9) ? atol(argv[9]) : 1;
+    bool ntt_evaluation = (argc > 10) && (atol(argv[10]) != 0);
+    size_t ps_low_degree = (argc > 11) ? atol(argv[11]) : 0;
+    size_t query_depth = (argc > 12) ? atol(argv[12]) : 0;
+    bool relin_free = (argc > 13) && (atol(argv[13]) != 0);
+    bool mask_pool = (argc > 14) && (atol(argv[14]) != 0);
+    bool seeded_queries = (argc > 15) && (atol(argv[15]) != 0);
+    bool seeded_keys = (argc > 16) && (atol(argv[16]) != 0);
+    bool packed_ciphertexts = (argc > 17) && (atol(argv[17]) != 0);
 
     auto random_factory = UniformRandomGeneratorFactory::default_factory();
     auto random = random_factory->create();
@@ -54,7 +110,20 @@ int main(int argc, char** argv)
         PSIParams params(receiver_size, sender_size, input_bits, poly_modulus_degree);
         params.set_sender_partition_count(partition_count);
         params.set_window_size(window_size);
+        params.set_thread_count(thread_count);
+        params.set_ntt_evaluation(ntt_evaluation);
+        params.set_ps_low_degree(ps_low_degree);
+        params.set_query_depth(query_depth);
+        params.set_relin_free(relin_free);
+        params.set_seeded_queries(seeded_queries);
+        params.set_seeded_keys(seeded_keys);
+        if (mask_pool) {
+            params.set_mask_pool_size((labeled ? 2 : 1) * partition_count);
+        }
         params.generate_seeds();
+        // the DB is built after the receiver has hashed its set, so the
+        // receiver can still pick other seeds if its set doesn't fit.
+        params.set_receiver_seed_retry(true);
 
         // do the actual benchmarking
         // phase 1: receiver encoding
@@ -63,23 +132,37 @@ int main(int argc, char** argv)
         PSIReceiver user(params);
         vector<bucket_slot> receiver_buckets;
         auto receiver_encrypted_inputs = user.encrypt_inputs(receiver_inputs, receiver_buckets);
+        RelinKeys relin_keys;
+        if (!relin_free) {
+            relin_keys = user.relin_keys();
+        }
 
         auto receiver_enc_end = chrono::system_clock::now();
         chrono::duration<double> receiver_enc_duration = receiver_enc_end - receiver_enc_start;
 
-        // phase 2: sender
-        auto sender_start = chrono::system_clock::now();
+        // phase 2a: sender preprocessing (independent of the query)
+        auto sender_db_start = chrono::system_clock::now();
 
-        PSISender server(params);
         optional<vector<uint64_t>> labels;
         if (labeled) {
             labels = sender_labels;
         }
+        PSISenderDB sender_db(params, sender_inputs, labels);
+
+        auto sender_db_end = chrono::system_clock::now();
+        chrono::duration<double> sender_db_duration = sender_db_end - sender_db_start;
+
+        // the masks are made in the background before the query arrives
+        PSISender server(params);
+        server.prepare_masks();
+
+        // phase 2b: sender
+        auto sender_start = chrono::system_clock::now();
+
         auto sender_matches = server.compute_matches(
-            sender_inputs,
-            labels,
+            sender_db,
             user.public_key(),
-            user.relin_keys(),
+            relin_keys,
             receiver_encrypted_inputs
         );
 
@@ -104,11 +187,48 @@ int main(int argc, char** argv)
         auto receiver_dec_end = chrono::system_clock::now();
         chrono::duration<double> receiver_dec_duration = receiver_dec_end - receiver_dec_start;
 
+        // everything the receiver uploads besides its public key
+        size_t upload_bytes = 0;
+        for (auto &ciphertext : receiver_encrypted_inputs) {
+            if (seeded_queries) {
+                // the seed and c0, as Networking::write_seeded_ciphertexts sends them
+                upload_bytes += 2 * sizeof(uint64_t)
+                                + seeded_polynomial_size(params.context, ciphertext, packed_ciphertexts);
+            } else if (packed_ciphertexts) {
+                upload_bytes += packed_ciphertext_size(params.context, ciphertext);
+            } else {
+                upload_bytes += serialized_size(ciphertext);
+            }
+        }
+        if (!relin_free && seeded_keys) {
+            // the seed and every c0, as Networking::write_seeded_relin_keys
+            // sends them, not counting a few bytes of metadata
+            upload_bytes += 2 * sizeof(uint64_t);
+            for (auto &key : relin_keys.data()) {
+                for (auto &ciphertext : key) {
+                    upload_bytes += seeded_polynomial_size(params.context, ciphertext, packed_ciphertexts);
+                }
+            }
+        } else if (!relin_free) {
+            upload_bytes += serialized_size(relin_keys);
+        }
+        // and everything the sender sends back
+        size_t download_bytes = 0;
+        for (auto &ciphertext : sender_matches) {
+            download_bytes += packed_ciphertexts
+                              ? packed_ciphertext_size(params.context, ciphertext)
+                              : serialized_size(ciphertext);
+        }
+
         // output the timings
         cout << sender_duration.count()
              << "\t" << receiver_enc_duration.count()
              << "\t" << receiver_dec_duration.count()
              << "\t" << match_count
+             << "\t" << sender_db_duration.count()
+             << "\t" << user.seed_retries()
+             << "\t" << upload_bytes
+             << "\t" << download_bytes
              << endl;
     }
 
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include <immintrin.h>
+
+#include "bitpacking.h"
+
+size_t packed_size(size_t count, size_t bits)
+{
+    return (count * bits + 7) / 8;
+}
+
+#if defined(__AVX512VBMI__)
+/* 8 values of `bits` bits take exactly `bits` bytes. value j of a group starts
+   at bit j * bits, which is byte (j * bits) / 8 plus a shift of
+   (j * bits) % 8 bits. for bits <= 57, the shifted value fits in the 8 bytes
+   from there, so each value is one 64-bit lane of bytes that a byte
+   permutation puts into (or takes from) the group's bytes. */
+struct packing_lanes {
+    __m512i bytes_of_lanes;
+    __m512i shifts;
+    __m512i mask;
+
+    packing_lanes(size_t bits) {
+        alignas(64) uint8_t indices[64];
+        alignas(64) uint64_t lane_shifts[8];
+        for (size_t j = 0; j < 8; j++) {
+            for (size_t b = 0; b < 8; b++) {
+                indices[8 * j + b] = (uint8_t) ((j * bits) / 8 + b);
+            }
+            lane_shifts[j] = (j * bits) % 8;
+        }
+        bytes_of_lanes = _mm512_load_si512((const void*) indices);
+        shifts = _mm512_load_si512((const void*) lane_shifts);
+        mask = _mm512_set1_epi64((1ull << bits) - 1);
+    }
+};
+
+/* where each byte of a packed group comes from, for packing. for bits >= 8,
+   the bytes that even values occupy don't overlap each other, and neither do
+   those of odd ones, so every byte belongs to at most one even and one odd
+   lane. */
+void pack_permutations(size_t bits, __m512i &even, __mmask64 &even_mask, __m512i &odd, __mmask64 &odd_mask)
+{
+    alignas(64) uint8_t even_indices[64] = {}, odd_indices[64] = {};
+    even_mask = 0;
+    odd_mask = 0;
+    for (size_t j = 0; j < 8; j++) {
+        size_t start = (j * bits) / 8;
+        size_t end = (j * bits + bits + 7) / 8;
+        for (size_t b = 0; start + b < end; b++) {
+            if (j % 2 == 0) {
+                even_indices[start + b] = (uint8_t) (8 * j + b);
+                even_mask |= (1ull << (start + b));
+            } else {
+                odd_indices[start + b] = (uint8_t) (8 * j + b);
+                odd_mask |= (1ull << (start + b));
+            }
+        }
+    }
+    even = _mm512_load_si512((const void*) even_indices);
+    odd = _mm512_load_si512((const void*) odd_indices);
+}
+#endif
+
+void pack_bits(const uint64_t *values, size_t count, size_t bits, uint8_t *destination)
+{
+    assert((bits > 0) && (bits <= 64));
+    size_t i = 0;
+
+#if defined(__AVX512VBMI__)
+    if ((bits >= 8) && (bits <= 57)) {
+        packing_lanes lanes(bits);
+        __m512i even, odd;
+        __mmask64 even_mask, odd_mask;
+        pack_permutations(bits, even, even_mask, odd, odd_mask);
+        __mmask64 group_mask = (1ull << bits) - 1;
+        for (; i + 8 <= count; i += 8) {
+            __m512i shifted = _mm512_sllv_epi64(
+                _mm512_and_si512(_mm512_loadu_si512((const void*) (values + i)), lanes.mask),
+                lanes.shifts);
+            __m512i group = _mm512_or_si512(_mm512_maskz_permutexvar_epi8(even_mask, even, shifted),
+                                            _mm512_maskz_permutexvar_epi8(odd_mask, odd, shifted));
+            _mm512_mask_storeu_epi8((void*) (destination + (i / 8) * bits), group_mask, group);
+        }
+    }
+#endif
+
+    // the rest go through a 128-bit buffer, which is flushed 64 bits at a time
+    uint8_t *output = destination + (i / 8) * bits;
+    __uint128_t buffer = 0;
+    size_t buffered_bits = 0;
+    for (; i < count; i++) {
+        buffer |= ((__uint128_t) values[i]) << buffered_bits;
+        buffered_bits += bits;
+        if (buffered_bits >= 64) {
+            uint64_t word = (uint64_t) buffer;
+            memcpy(output, &word, 8);
+            output += 8;
+            buffer >>= 64;
+            buffered_bits -= 64;
+        }
+    }
+    uint64_t word = (uint64_t) buffer;
+    memcpy(output, &word, (buffered_bits + 7) / 8);
+}
+
+void unpack_bits(const uint8_t *source, size_t count, size_t bits, uint64_t *values)
+{
+    assert((bits > 0) && (bits <= 64));
+    uint64_t mask = (bits == 64) ? ~0ull : ((1ull << bits) - 1);
+    size_t size = packed_size(count, bits);
+    size_t i = 0;
+
+#if defined(__AVX512VBMI__)
+    if (bits <= 57) {
+        packing_lanes lanes(bits);
+        // each group is read with a 64-byte load, which must stay in bounds
+        for (; (i + 8 <= count) && ((i / 8) * bits + 64 <= size); i += 8) {
+            __m512i group = _mm512_loadu_si512((const void*) (source + (i / 8) * bits));
+            __m512i lanes_of_bytes = _mm512_permutexvar_epi8(lanes.bytes_of_lanes, group);
+            _mm512_storeu_si512((void*) (values + i),
+                                _mm512_and_si512(_mm512_srlv_epi64(lanes_of_bytes, lanes.shifts), lanes.mask));
+        }
+    }
+#endif
+
+    // value i is in the (at most 9) bytes from bit i * bits on
+    for (; i < count; i++) {
+        size_t bit = i * bits;
+        size_t start = bit / 8;
+        __uint128_t window = 0;
+        if (start + 16 <= size) {
+            memcpy(&window, source + start, 16);
+        } else {
+            memcpy(&window, source + start, size - start);
+        }
+        values[i] = ((uint64_t) (window >> (bit % 8))) & mask;
+    }
+}
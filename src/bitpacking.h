@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+/*
+pack_bits(values, count, bits, destination) writes the low `bits` bits of each
+of values[0..count) back to back, in little-endian bit order, to the
+packed_size(count, bits) bytes at `destination`. the higher bits of the values
+must be zero. unpack_bits(source, count, bits, values) reverses it.
+
+this packs ciphertext coefficients, which are reduced mod a prime of fewer
+than 64 bits, to the width of the prime. with AVX-512 VBMI, and if bits <= 57
+(and bits >= 8, for packing), 8 values at a time are moved into place with
+byte permutations and shifts; otherwise, and for the last few values, one at a
+time.
+*/
+size_t packed_size(size_t count, size_t bits);
+
+void pack_bits(const uint64_t *values, size_t count, size_t bits, uint8_t *destination);
+
+void unpack_bits(const uint8_t *source, size_t count, size_t bits, uint64_t *values);
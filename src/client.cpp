@@ -1,5 +1,7 @@
 #include <cassert>
+#include <cstdlib>
 #include <iostream>
+#include <stdexcept>
 
 #include "boost/asio.hpp"
 
@@ -8,12 +10,13 @@
 using namespace std;
 using namespace boost::asio;
 
-int main()
+/* queries `inputs` in a connection of its own, and prints the matches. up to
+   stash_size inputs that don't fit into the cuckoo hash table are left out of
+   the query and put into `stashed`. returns false if the query failed. */
+bool run_query(vector<uint64_t> &inputs, size_t stash_size, vector<uint64_t> &stashed)
 {
-    vector<uint64_t> inputs = {0x02, 0x07, 0x05, 0xfe};
     size_t input_bits = 32;
     size_t poly_modulus_degree = 8192;
-    unsigned short port = 9999;
 
     io_context context;
     ip::tcp::socket socket(context);
@@ -21,29 +24,87 @@ int main()
     connect(socket, resolver.resolve("localhost", "9999", resolver.numeric_service));
     Networking net(socket);
 
-    cout << "connected, waiting for hello and set size" << endl;
+    cout << "connected, waiting for hello, set size, seeds, mode and query params" << endl;
     net.read_hello();
     size_t sender_size = net.read_uint32();
+    // the sender owns the hash seeds: it has already hashed its set with them.
+    vector<uint64_t> seeds;
+    net.read_uint64s(seeds);
+    uint32_t mode = net.read_uint32();
+    bool relin_free = ((mode & NET_MODE_RELIN_FREE) != 0);
+    // we send seeded ciphertexts whenever the sender accepts them
+    bool seeded_queries = ((mode & NET_MODE_SEEDED_QUERIES) != 0);
+    bool seeded_keys = ((mode & NET_MODE_SEEDED_KEYS) != 0);
+    bool packed_ciphertexts = ((mode & NET_MODE_PACKED_CIPHERTEXTS) != 0);
+    // the sender's DB fixes how the query has to look
+    size_t partition_count = net.read_uint32();
+    size_t window_size = net.read_uint32();
+    size_t ps_low_degree = net.read_uint32();
+    size_t query_depth = net.read_uint32();
 
     cout << "picking params" << endl;
     PSIParams params(inputs.size(), sender_size, input_bits, poly_modulus_degree);
-    params.generate_seeds();
+    params.set_seeds(seeds);
+    params.set_sender_partition_count(partition_count);
+    params.set_window_size(window_size);
+    params.set_ps_low_degree(ps_low_degree);
+    params.set_query_depth(query_depth);
+    if ((partition_count == 0) || (partition_count > params.sender_bucket_capacity())) {
+        cout << "the sender sent an invalid partition count" << endl;
+        return false;
+    }
+    params.set_receiver_stash_size(stash_size);
+    try {
+        params.set_relin_free(relin_free);
+    } catch (const runtime_error &error) {
+        cout << "the sender sent invalid query params: " << error.what() << endl;
+        return false;
+    }
+    params.set_seeded_queries(seeded_queries);
+    params.set_seeded_keys(seeded_keys);
     net.set_seal_context(params.context);
+    net.set_packed_polynomials(packed_ciphertexts);
     PSIReceiver receiver(params);
 
-    cout << "sending hello, set size, seeds, pk, relin keys" << endl;
+    cout << "sending hello, set size, pk" << (relin_free ? "" : ", relin keys") << endl;
     net.write_hello();
     net.write_uint32(inputs.size());
-    net.write_uint64s(params.seeds);
-    net.write_public_key(receiver.public_key());
-    net.write_relin_keys(receiver.relin_keys());
+    if (seeded_keys) {
+        net.write_seeded_public_key(receiver.public_key(), receiver.public_key_seed());
+    } else {
+        net.write_public_key(receiver.public_key());
+    }
+    if (!relin_free) {
+        RelinKeys relin_keys = receiver.relin_keys();
+        if (seeded_keys) {
+            net.write_seeded_relin_keys(relin_keys, receiver.relin_keys_seed());
+        } else {
+            net.write_relin_keys(relin_keys);
+        }
+    }
 
     cout << "encrypting inputs" << endl;
     vector<bucket_slot> buckets;
-    auto encrypted_inputs = receiver.encrypt_inputs(inputs, buckets);
+    vector<Ciphertext> encrypted_inputs;
+    try {
+        encrypted_inputs = receiver.encrypt_inputs(inputs, buckets);
+    } catch (const runtime_error &error) {
+        cout << "can't query: " << error.what() << endl;
+        return false;
+    }
+    stashed.clear();
+    for (size_t index : receiver.stash()) {
+        stashed.push_back(inputs[index]);
+    }
 
     cout << "sending inputs" << endl;
-    net.write_ciphertexts(encrypted_inputs);
+    if (seeded_queries) {
+        net.write_seeded_ciphertexts(encrypted_inputs, receiver.query_seeds());
+    } else if (packed_ciphertexts) {
+        net.write_packed_ciphertexts(encrypted_inputs);
+    } else {
+        net.write_ciphertexts(encrypted_inputs);
+    }
 
     cout << "waiting for encrypted matches" << endl;
     vector<Ciphertext> encrypted_matches;
@@ -59,4 +120,38 @@ int main()
         cout << inputs[buckets[i.first].first] << "-" << i.second << " ";
     }
     cout << endl;
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    vector<uint64_t> inputs = {0x02, 0x07, 0x05, 0xfe};
+    // the sender has already hashed its set with its seeds, so we can't pick
+    // other ones. instead, up to this many inputs that don't fit into the
+    // cuckoo hash table go into a stash, and we query them in a second, tiny
+    // query, into whose table they fit easily.
+    size_t stash_size = 16;
+    // if set, the stashed inputs are left out instead, and never queried.
+    bool drop_stash = (argc > 1) && (atol(argv[1]) != 0);
+
+    vector<uint64_t> stashed;
+    if (!run_query(inputs, stash_size, stashed)) {
+        return 1;
+    }
+    if (stashed.empty()) {
+        return 0;
+    }
+    if (drop_stash) {
+        cout << stashed.size() << " inputs didn't fit and weren't queried" << endl;
+        return 0;
+    }
+
+    cout << "querying the " << stashed.size() << " inputs that didn't fit" << endl;
+    // nothing may be left out this time
+    vector<uint64_t> stashed_again;
+    if (!run_query(stashed, 0, stashed_again)) {
+        return 1;
+    }
+    assert(stashed_again.empty());
+    return 0;
 }
@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <cassert>
+
+#include <immintrin.h>
+
+#include "dot_product.h"
+
+// the number of coefficients whose accumulators are kept at a time, so that
+// they stay in L1 cache
+const size_t DOT_PRODUCT_BLOCK_SIZE = 256;
+
+void dot_product_mod_128(const uint64_t *const *a,
+                         const uint64_t *const *b,
+                         size_t count,
+                         size_t n,
+                         uint64_t modulus,
+                         uint64_t *destination)
+{
+    // an accumulator that's less than the modulus can take this many more
+    // products of reduced values without overflowing.
+    __uint128_t max_product = ((__uint128_t) (modulus - 1)) * (modulus - 1);
+    size_t max_terms = (max_product == 0)
+                       ? count
+                       : (size_t) min<__uint128_t>(count, (~((__uint128_t) 0) - modulus) / max_product);
+    assert(max_terms > 0);
+
+    __uint128_t accumulators[DOT_PRODUCT_BLOCK_SIZE];
+    for (size_t start = 0; start < n; start += DOT_PRODUCT_BLOCK_SIZE) {
+        size_t block_size = min(DOT_PRODUCT_BLOCK_SIZE, n - start);
+        fill_n(accumulators, block_size, 0);
+
+        size_t terms_since_reduction = 0;
+        for (size_t j = 0; j < count; j++) {
+            if (terms_since_reduction == max_terms) {
+                for (size_t k = 0; k < block_size; k++) {
+                    accumulators[k] %= modulus;
+                }
+                terms_since_reduction = 0;
+            }
+            const uint64_t *a_j = a[j] + start;
+            const uint64_t *b_j = b[j] + start;
+            for (size_t k = 0; k < block_size; k++) {
+                accumulators[k] += ((__uint128_t) a_j[k]) * b_j[k];
+            }
+            terms_since_reduction++;
+        }
+
+        for (size_t k = 0; k < block_size; k++) {
+            destination[start + k] = (uint64_t) (accumulators[k] % modulus);
+        }
+    }
+}
+
+/* for modulus < 2^52: vpmadd52luq and vpmadd52huq add the low and high 52 bits
+   of a 104-bit product to 64-bit lanes, so each accumulator is split into a
+   low and a high half, which can each take 2^11 products before they could
+   overflow. the value of a coefficient is then (high << 52) + low. */
+__attribute__((target("avx512f,avx512ifma")))
+void dot_product_mod_ifma(const uint64_t *const *a,
+                          const uint64_t *const *b,
+                          size_t count,
+                          size_t n,
+                          uint64_t modulus,
+                          uint64_t *destination)
+{
+    const size_t max_terms = (1 << 11) - 1;
+    const size_t lanes = 8;
+
+    alignas(64) uint64_t low[DOT_PRODUCT_BLOCK_SIZE];
+    alignas(64) uint64_t high[DOT_PRODUCT_BLOCK_SIZE];
+    for (size_t start = 0; start < n; start += DOT_PRODUCT_BLOCK_SIZE) {
+        size_t block_size = min(DOT_PRODUCT_BLOCK_SIZE, n - start);
+        size_t vector_size = block_size - (block_size % lanes);
+        fill_n(low, block_size, 0);
+        fill_n(high, block_size, 0);
+
+        size_t terms_since_reduction = 0;
+        for (size_t j = 0; j < count; j++) {
+            if (terms_since_reduction == max_terms) {
+                for (size_t k = 0; k < block_size; k++) {
+                    low[k] = (uint64_t) (((((__uint128_t) high[k]) << 52) + low[k]) % modulus);
+                    high[k] = 0;
+                }
+                terms_since_reduction = 1;
+            }
+            const uint64_t *a_j = a[j] + start;
+            const uint64_t *b_j = b[j] + start;
+            for (size_t k = 0; k < vector_size; k += lanes) {
+                __m512i a_k = _mm512_loadu_si512((const void*) (a_j + k));
+                __m512i b_k = _mm512_loadu_si512((const void*) (b_j + k));
+                __m512i low_k = _mm512_load_si512((const void*) (low + k));
+                __m512i high_k = _mm512_load_si512((const void*) (high + k));
+                _mm512_store_si512((void*) (low + k), _mm512_madd52lo_epu64(low_k, a_k, b_k));
+                _mm512_store_si512((void*) (high + k), _mm512_madd52hi_epu64(high_k, a_k, b_k));
+            }
+            for (size_t k = vector_size; k < block_size; k++) {
+                __uint128_t product = ((__uint128_t) a_j[k]) * b_j[k];
+                low[k] += (uint64_t) (product & ((1ull << 52) - 1));
+                high[k] += (uint64_t) (product >> 52);
+            }
+            terms_since_reduction++;
+        }
+
+        for (size_t k = 0; k < block_size; k++) {
+            destination[start + k] = (uint64_t) (((((__uint128_t) high[k]) << 52) + low[k]) % modulus);
+        }
+    }
+}
+
+/* for 2^52 <= modulus < 2^62: each input is split into 52-bit limbs,
+   x = x_1 * 2^52 + x_0, where x_1 < 2^10. the product then has partial
+   products of weight 1, 2^52 and 2^104, and each gets its own accumulator,
+   which is enough for (2^12 / 3) products: the one of weight 2^52 gets three
+   values of less than 2^52 per product. the 52-bit multiply-accumulate
+   instructions only look at the low 52 bits of their inputs, so x_0 is just x.
+   the value of a coefficient is (high << 104) + (middle << 52) + low. */
+__attribute__((target("avx512f,avx512ifma")))
+void dot_product_mod_ifma_wide(const uint64_t *const *a,
+                               const uint64_t *const *b,
+                               size_t count,
+                               size_t n,
+                               uint64_t modulus,
+                               uint64_t *destination)
+{
+    const size_t max_terms = (1 << 12) / 3;
+    const size_t lanes = 8;
+    const uint64_t limb_mask = (1ull << 52) - 1;
+    uint64_t middle_weight = (uint64_t) ((((__uint128_t) 1) << 52) % modulus);
+    uint64_t high_weight = (uint64_t) ((((__uint128_t) middle_weight) << 52) % modulus);
+    auto reduce = [&](uint64_t low, uint64_t middle, uint64_t high) {
+        __uint128_t value = (__uint128_t) low
+                            + ((__uint128_t) (middle % modulus)) * middle_weight
+                            + ((__uint128_t) (high % modulus)) * high_weight;
+        return (uint64_t) (value % modulus);
+    };
+
+    alignas(64) uint64_t low[DOT_PRODUCT_BLOCK_SIZE];
+    alignas(64) uint64_t middle[DOT_PRODUCT_BLOCK_SIZE];
+    alignas(64) uint64_t high[DOT_PRODUCT_BLOCK_SIZE];
+    for (size_t start = 0; start < n; start += DOT_PRODUCT_BLOCK_SIZE) {
+        size_t block_size = min(DOT_PRODUCT_BLOCK_SIZE, n - start);
+        size_t vector_size = block_size - (block_size % lanes);
+        fill_n(low, block_size, 0);
+        fill_n(middle, block_size, 0);
+        fill_n(high, block_size, 0);
+
+        size_t terms_since_reduction = 0;
+        for (size_t j = 0; j < count; j++) {
+            if (terms_since_reduction == max_terms) {
+                for (size_t k = 0; k < block_size; k++) {
+                    low[k] = reduce(low[k], middle[k], high[k]);
+                    middle[k] = 0;
+                    high[k] = 0;
+                }
+                terms_since_reduction = 1;
+            }
+            const uint64_t *a_j = a[j] + start;
+            const uint64_t *b_j = b[j] + start;
+            for (size_t k = 0; k < vector_size; k += lanes) {
+                __m512i a_k = _mm512_loadu_si512((const void*) (a_j + k));
+                __m512i b_k = _mm512_loadu_si512((const void*) (b_j + k));
+                __m512i a_high = _mm512_srli_epi64(a_k, 52);
+                __m512i b_high = _mm512_srli_epi64(b_k, 52);
+                __m512i low_k = _mm512_load_si512((const void*) (low + k));
+                __m512i middle_k = _mm512_load_si512((const void*) (middle + k));
+                __m512i high_k = _mm512_load_si512((const void*) (high + k));
+
+                low_k = _mm512_madd52lo_epu64(low_k, a_k, b_k);
+                middle_k = _mm512_madd52hi_epu64(middle_k, a_k, b_k);
+                middle_k = _mm512_madd52lo_epu64(middle_k, a_k, b_high);
+                middle_k = _mm512_madd52lo_epu64(middle_k, a_high, b_k);
+                high_k = _mm512_madd52hi_epu64(high_k, a_k, b_high);
+                high_k = _mm512_madd52hi_epu64(high_k, a_high, b_k);
+                high_k = _mm512_madd52lo_epu64(high_k, a_high, b_high);
+
+                _mm512_store_si512((void*) (low + k), low_k);
+                _mm512_store_si512((void*) (middle + k), middle_k);
+                _mm512_store_si512((void*) (high + k), high_k);
+            }
+            for (size_t k = vector_size; k < block_size; k++) {
+                __uint128_t product = ((__uint128_t) a_j[k]) * b_j[k];
+                low[k] += (uint64_t) (product & limb_mask);
+                middle[k] += (uint64_t) ((product >> 52) & limb_mask);
+                high[k] += (uint64_t) (product >> 104);
+            }
+            terms_since_reduction++;
+        }
+
+        for (size_t k = 0; k < block_size; k++) {
+            destination[start + k] = reduce(low[k], middle[k], high[k]);
+        }
+    }
+}
+
+void dot_product_mod(const uint64_t *const *a,
+                     const uint64_t *const *b,
+                     size_t count,
+                     size_t n,
+                     uint64_t modulus,
+                     uint64_t *destination)
+{
+    assert((modulus > 0) && (modulus < (1ull << 62)));
+
+    static const bool has_ifma = __builtin_cpu_supports("avx512ifma");
+    if (has_ifma && (modulus < (1ull << 52))) {
+        dot_product_mod_ifma(a, b, count, n, modulus, destination);
+    } else if (has_ifma) {
+        dot_product_mod_ifma_wide(a, b, count, n, modulus, destination);
+    } else {
+        dot_product_mod_128(a, b, count, n, modulus, destination);
+    }
+}
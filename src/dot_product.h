@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+/*
+dot_product_mod(a, b, count, n, modulus, destination) sets
+
+    destination[k] = (a[0][k] * b[0][k] + ... + a[count - 1][k] * b[count - 1][k]) mod modulus
+
+for k < n. all inputs must be reduced mod `modulus`, which must be less than
+2^62. destination may be one of the inputs.
+
+this is the inner loop of evaluating a polynomial in the NTT domain, where each
+product of a plaintext and a ciphertext is a pointwise product. instead of
+reducing every product and every sum, the products are accumulated without
+reduction and only reduced when the accumulators could overflow, which for
+60-bit moduli is every 255 terms:
+- on CPUs with AVX-512 IFMA, 8 coefficients at a time are accumulated with
+  the 52-bit multiply-accumulate instructions: in two 64-bit halves if the
+  modulus is less than 2^52, and otherwise (like the 60-bit primes of SEAL's
+  default coefficient moduli) in three, one per weight of the partial
+  products of 52-bit limbs.
+- otherwise, each coefficient has a 128-bit accumulator.
+the CPU is checked at runtime, so the same binary runs on CPUs without IFMA.
+*/
+void dot_product_mod(const uint64_t *const *a,
+                     const uint64_t *const *b,
+                     size_t count,
+                     size_t n,
+                     uint64_t modulus,
+                     uint64_t *destination);
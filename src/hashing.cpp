@@ -1,8 +1,10 @@
+#include <algorithm>
 #include <cassert>
 
 #include "aes.h"
 
 #include "hashing.h"
+#include "threads.h"
 
 using namespace std;
 
@@ -16,45 +18,84 @@ size_t loc_aes_hash(AES &aes, size_t m, uint64_t value) {
 	return aes_hash(aes, m, value >> m) ^ (value & ((1ull << m) - 1));
 }
 
+// how many blocks loc_aes_hash_batch encrypts with one call to encrypt_blocks
+const size_t AES_HASH_BATCH_SIZE = 256;
+
+void loc_aes_hash_batch(AES &aes, size_t m, const uint64_t *values, size_t count, uint32_t *locations) {
+	assert(m < 32);
+	uint64_t mask = (1ull << m) - 1;
+	__m128i blocks[AES_HASH_BATCH_SIZE];
+	for (size_t start = 0; start < count; start += AES_HASH_BATCH_SIZE) {
+		size_t batch_size = min(AES_HASH_BATCH_SIZE, count - start);
+		for (size_t i = 0; i < batch_size; i++) {
+			blocks[i] = _mm_set_epi64x(0, values[start + i] >> m);
+		}
+		aes.encrypt_blocks(blocks, blocks, batch_size);
+		// same as loc_aes_hash: the low half of the ciphertext, xored with
+		// the high bits of the value, then with its low bits
+		for (size_t i = 0; i < batch_size; i++) {
+			uint64_t value = values[start + i];
+			uint64_t hash = ((uint64_t) _mm_cvtsi128_si64(blocks[i])) ^ (value >> m);
+			locations[start + i] = (uint32_t) ((hash ^ value) & mask);
+		}
+	}
+}
+
 bool cuckoo_hash(shared_ptr<UniformRandomGenerator> random,
 	             vector<uint64_t> &inputs,
 	             size_t m,
 	             vector<bucket_slot> &buckets,
-	             vector<uint64_t> &seeds)
+	             vector<uint64_t> &seeds,
+	             vector<size_t> &stash,
+	             size_t max_stash_size)
 {
 	buckets.resize(1 << m);
 	for (size_t i = 0; i < buckets.size(); i++) {
 		buckets[i] = BUCKET_EMPTY;
 	}
-
-	vector<AES> aes(seeds.size());
-	for (size_t i = 0; i < seeds.size(); i++) {
-		aes[i].set_key(0, seeds[i]);
+	stash.clear();
+
+	// the location of input i under hash function j is
+	// locations[j * inputs.size() + i]. they are all computed up front, so
+	// that the AES encryptions can be batched.
+	vector<uint32_t> locations(seeds.size() * inputs.size());
+	for (size_t j = 0; j < seeds.size(); j++) {
+		AES aes;
+		aes.set_key(0, seeds[j]);
+		loc_aes_hash_batch(aes, m, inputs.data(), inputs.size(), &locations[j * inputs.size()]);
 	}
 
+	AESRandom fast_random(random);
 	for (size_t i = 0; i < inputs.size(); i++) {
-		bool resolved = false;
 		bucket_slot current_item = make_pair(
 			i,
-			random_integer(random, seeds.size())
+			fast_random.integer(seeds.size())
 		);
 
-		// TODO: keep track of # of operations and abort if exceeding some limit
-		while (!resolved) {
-			size_t loc = loc_aes_hash(
-				aes[current_item.second],
-				m,
-				inputs[current_item.first]
-			);
+		for (size_t evictions = 0; ; evictions++) {
+			size_t loc = locations[current_item.second * inputs.size() + current_item.first];
 
 			buckets[loc].swap(current_item);
 
 			if (current_item == BUCKET_EMPTY) {
-				resolved = true;
-			} else {
+				break;
+			}
+
+			if (evictions == CUCKOO_MAX_EVICTIONS) {
+				// the eviction chain is too long, which almost always means
+				// that there is no room left for the elements it goes
+				// through. the element we're left holding goes to the stash.
+				if (stash.size() == max_stash_size) {
+					return false;
+				}
+				stash.push_back(current_item.first);
+				break;
+			}
+
+			if (seeds.size() > 1) {
 				size_t old_hash = current_item.second;
 				while (current_item.second == old_hash) {
-					current_item.second = random_integer(random, seeds.size());
+					current_item.second = fast_random.integer(seeds.size());
 				}
 			}
 		}
@@ -67,48 +108,104 @@ bool complete_hash(shared_ptr<UniformRandomGenerator> random,
 	               vector<uint64_t> &inputs,
                    size_t m,
                    size_t capacity,
-                   vector<bucket_slot> &buckets,
-                   vector<uint64_t> &seeds)
+                   vector<packed_slot> &buckets,
+                   vector<uint64_t> &seeds,
+                   size_t thread_count)
 {
-	buckets.resize(capacity << m);
-	for (size_t i = 0; i < buckets.size(); i++) {
-		buckets[i] = BUCKET_EMPTY;
-	}
+	assert(seeds.size() <= 3);
+	assert(inputs.size() < PACKED_SLOT_MAX_INPUTS);
+	// bucket indices are stored in 16 bits
+	assert(m <= 16);
+	assert(thread_count > 0);
+
+	size_t bucket_count = (1ull << m);
+	size_t hash_count = seeds.size();
+
+	// the inputs are split into `thread_count` contiguous chunks, one per
+	// thread.
+	thread_count = max<size_t>(1, min(thread_count, inputs.size()));
+	size_t chunk_size = (inputs.size() + thread_count - 1) / thread_count;
+
+	// first, each thread computes the buckets of its chunk (locations[i *
+	// hash_count + j] is the bucket of input i under hash function j) and
+	// counts how many elements go into each bucket.
+	vector<uint16_t> locations(inputs.size() * hash_count);
+	vector<vector<size_t>> counts(thread_count);
+
+	run_workers(thread_count, [&](size_t t) {
+		vector<AES> aes(hash_count);
+		for (size_t j = 0; j < hash_count; j++) {
+			aes[j].set_key(0, seeds[j]);
+		}
 
-	vector<AES> aes(seeds.size());
-	for (size_t i = 0; i < seeds.size(); i++) {
-		aes[i].set_key(0, seeds[i]);
-	}
+		counts[t].assign(bucket_count, 0);
+		size_t chunk_end = min(inputs.size(), (t + 1) * chunk_size);
+		// the chunk is hashed in batches, one hash function at a time
+		uint32_t batch_locations[AES_HASH_BATCH_SIZE];
+		for (size_t start = t * chunk_size; start < chunk_end; start += AES_HASH_BATCH_SIZE) {
+			size_t batch_size = min(AES_HASH_BATCH_SIZE, chunk_end - start);
+			for (size_t j = 0; j < hash_count; j++) {
+				loc_aes_hash_batch(aes[j], m, &inputs[start], batch_size, batch_locations);
+				for (size_t i = 0; i < batch_size; i++) {
+					size_t loc = batch_locations[i];
+					locations[(start + i) * hash_count + j] = (uint16_t) loc;
+					counts[t][loc]++;
+				}
+			}
+		}
+	});
+
+	// then, turn the counts into the row where each thread starts writing in
+	// each bucket. filling the buckets chunk by chunk puts the elements in the
+	// same deterministic order as inserting them one by one would.
+	for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+		size_t rows_used = 0;
+		for (size_t t = 0; t < thread_count; t++) {
+			size_t count = counts[t][bucket];
+			counts[t][bucket] = rows_used;
+			rows_used += count;
+		}
 
-	vector<size_t> capacity_used(1 << m);
+		if (rows_used > capacity) {
+			// all slots in the bucket are used, so we cannot add all elements
+			return false;
+		}
+	}
 
-	// insert all elements into the table in a deterministic order (filling each
-	// bucket sequentially)
-	for (size_t i = 0; i < inputs.size(); i++) {
-		for (size_t j = 0; j < seeds.size(); j++) {
-			size_t loc = loc_aes_hash(aes[j], m, inputs[i]);
+	buckets.assign(capacity << m, PACKED_SLOT_EMPTY);
 
-			if (capacity_used[loc] == capacity) {
-				// all slots in the bucket are used, so we cannot add this
-				// element
-				return false;
+	run_workers(thread_count, [&](size_t t) {
+		vector<size_t> &next_row = counts[t];
+		size_t chunk_end = min(inputs.size(), (t + 1) * chunk_size);
+		for (size_t i = t * chunk_size; i < chunk_end; i++) {
+			for (size_t j = 0; j < hash_count; j++) {
+				size_t loc = locations[i * hash_count + j];
+				buckets[complete_hash_index(m, loc, next_row[loc])] = pack_slot(i, j);
+				next_row[loc]++;
 			}
-
-			buckets[capacity * loc + capacity_used[loc]] = make_pair(i, j);
-			capacity_used[loc]++;
 		}
-	}
+	});
 
 	// now shuffle each bucket, to avoid leaking information about bucket load
-	// distribution through partitioning
-	for (size_t bucket = 0; bucket < (1 << m); bucket++) {
-		for (size_t slot = 1; slot < capacity; slot++) {
-			// uniformly pick a random slot before this one (possibly this
-			// very same one) and swap
-			size_t prev_slot = random_integer(random, slot + 1);
-			buckets[capacity * bucket + slot].swap(buckets[capacity * bucket + prev_slot]);
-		}
+	// distribution through partitioning. thread t shuffles buckets t,
+	// t + thread_count, ..., with its own random generator, since they aren't
+	// thread-safe. they are all keyed from `random` up front.
+	vector<AESRandom> thread_randoms;
+	for (size_t t = 0; t < thread_count; t++) {
+		thread_randoms.emplace_back(random);
 	}
+	run_workers(thread_count, [&](size_t t) {
+		AESRandom &thread_random = thread_randoms[t];
+		for (size_t bucket = t; bucket < bucket_count; bucket += thread_count) {
+			for (size_t slot = 1; slot < capacity; slot++) {
+				// uniformly pick a random slot before this one (possibly this
+				// very same one) and swap
+				size_t prev_slot = thread_random.integer(slot + 1);
+				swap(buckets[complete_hash_index(m, bucket, slot)],
+				     buckets[complete_hash_index(m, bucket, prev_slot)]);
+			}
+		}
+	});
 
 	return true;
 }
@@ -3,12 +3,53 @@
 #include <utility>
 #include <vector>
 
+#include "aes.h"
 #include "random.h"
 
 typedef pair<size_t, size_t> bucket_slot;
 
 const bucket_slot BUCKET_EMPTY = make_pair(0xFFFFFFFFul, 0xFFFFFFFFul);
 
+/* The sender's hash table is much bigger than the receiver's, so its slots are
+   packed into 32 bits: the index of the input in the upper 30 bits, and the
+   index of the hash function in the lower 2. An empty slot has all bits set,
+   so its hash function index is 3, which is never used by a real element. */
+typedef uint32_t packed_slot;
+
+const packed_slot PACKED_SLOT_EMPTY = 0xFFFFFFFFu;
+// the input index of an empty slot, which real elements can't use
+const size_t PACKED_SLOT_MAX_INPUTS = (1ull << 30) - 1;
+
+inline packed_slot pack_slot(size_t input_index, size_t seed_index) {
+    return (packed_slot) ((input_index << 2) | seed_index);
+}
+
+inline size_t slot_input_index(packed_slot slot) {
+    return slot >> 2;
+}
+
+inline size_t slot_seed_index(packed_slot slot) {
+    return slot & 3;
+}
+
+/* The index of the jth slot of bucket i in a table built by complete_hash. */
+inline size_t complete_hash_index(size_t m, size_t bucket, size_t row) {
+    return (row << m) | bucket;
+}
+
+/* Computes the bucket (out of 2^m) that `value` is placed into by the
+   permutation-based hash function keyed by `aes`. */
+size_t loc_aes_hash(AES &aes, size_t m, uint64_t value);
+
+/* Sets locations[i] = loc_aes_hash(aes, m, values[i]) for i < count, encrypting
+   the values in batches with AES::encrypt_blocks, which is several times
+   faster than hashing them one by one. */
+void loc_aes_hash_batch(AES &aes, size_t m, const uint64_t *values, size_t count, uint32_t *locations);
+
+// the number of elements that inserting one element into a cuckoo hash table
+// may evict before giving up
+const size_t CUCKOO_MAX_EVICTIONS = 500;
+
 /* Given a set of inputs, a number of buckets, and seeds for a hash function,
    performs permutation-based cuckoo hashing to put at most one element in each
    bucket.
@@ -17,24 +58,40 @@ const bucket_slot BUCKET_EMPTY = make_pair(0xFFFFFFFFul, 0xFFFFFFFFul);
    The number of buckets is 2^m. Non-empty buckets will contain
    (input_index, seed_index), empty ones will be equal to BUCKET_EMPTY.
    Seeds should be random 64-bit values.
+   An insertion that would evict more than CUCKOO_MAX_EVICTIONS elements puts
+   the element it is left with into `stash` (as an input index) instead, and
+   if there are already max_stash_size elements there, cuckoo_hash gives up
+   and returns false. The table can then only be built with other seeds.
 */
 bool cuckoo_hash(shared_ptr<UniformRandomGenerator> random,
                  vector<uint64_t> &inputs,
                  size_t m,
                  vector<bucket_slot> &buckets,
-                 vector<uint64_t> &seeds);
+                 vector<uint64_t> &seeds,
+                 vector<size_t> &stash,
+                 size_t max_stash_size = 0);
 
 /* Given a set of inputs, a number of buckets, and seeds for a hash function,
    places every input, hashed with *every* function, into the corresponding
    bucket, using permutation-based hashing.
-   The number of buckets is 2^m. Non-empty buckets will contain
-   (input_index, seed_index), empty ones will be equal to BUCKET_EMPTY.
-   jth element of bucket number i is stored in buckets[i * capacity + j].
+   The number of buckets is 2^m. Non-empty slots will contain
+   pack_slot(input_index, seed_index), empty ones will be equal to
+   PACKED_SLOT_EMPTY. There can be at most 3 seeds, and fewer than
+   PACKED_SLOT_MAX_INPUTS inputs.
+   The table is row-major: the jth element of bucket number i is stored in
+   buckets[complete_hash_index(m, i, j)] = buckets[j * 2^m + i], so that any
+   range of rows (such as one of the sender's partitions) is a contiguous part
+   of the table, and the slots of one row are in bucket order, which is the
+   order of the slots of a batched plaintext.
    Seeds should be random 64-bit values.
+   The hashing, sorting into buckets and shuffling of the buckets are split
+   across `thread_count` threads. The elements of every bucket are shuffled
+   uniformly, whatever the number of threads.
 */
 bool complete_hash(shared_ptr<UniformRandomGenerator> random,
                    vector<uint64_t> &inputs,
                    size_t m,
                    size_t capacity,
-                   vector<bucket_slot> &buckets,
-                   vector<uint64_t> &seeds);
+                   vector<packed_slot> &buckets,
+                   vector<uint64_t> &seeds,
+                   size_t thread_count);
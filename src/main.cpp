@@ -35,6 +35,9 @@ int main()
     params.set_sender_partition_count(partition_count);
     params.set_window_size(window_size);
     params.generate_seeds();
+    // the sender hashes its set after the receiver, so the receiver can still
+    // pick other seeds if its set doesn't fit with these ones.
+    params.set_receiver_seed_retry(true);
 
     cout << "Parameters chosen:" << endl;
     cout << "  - sender set size: " << params.sender_size << endl;
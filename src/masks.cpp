@@ -0,0 +1,98 @@
+#include "masks.h"
+
+void random_mask(AESRandom &random, BatchEncoder &encoder, uint64_t plain_modulus, Plaintext &destination)
+{
+    size_t slot_count = encoder.slot_count();
+    destination.parms_id() = parms_id_zero;
+    destination.resize(slot_count);
+    random.fill_nonzero_integers(destination.data(), slot_count, plain_modulus);
+    encoder.encode(destination);
+}
+
+MaskPool::MaskPool(shared_ptr<SEALContext> context, size_t capacity)
+    : context(context),
+      capacity(capacity),
+      running_queries(0),
+      stopping(false)
+{
+    masks.reserve(capacity);
+    refiller = thread(&MaskPool::refill, this);
+}
+
+MaskPool::~MaskPool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    refiller.join();
+}
+
+void MaskPool::wait_until_full()
+{
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [&] { return masks.size() == capacity; });
+}
+
+void MaskPool::begin_query()
+{
+    lock_guard<mutex> guard(lock);
+    running_queries++;
+}
+
+void MaskPool::end_query()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        running_queries--;
+    }
+    changed.notify_all();
+}
+
+bool MaskPool::pop(Plaintext &destination)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        if (masks.empty()) {
+            return false;
+        }
+        destination = move(masks.back());
+        masks.pop_back();
+    }
+    changed.notify_all();
+    return true;
+}
+
+void MaskPool::refill()
+{
+    // only this thread uses these
+    auto random_factory = UniformRandomGeneratorFactory::default_factory();
+    AESRandom random(random_factory->create());
+    BatchEncoder encoder(context);
+    Evaluator evaluator(context);
+    uint64_t plain_modulus = context->first_context_data()->parms().plain_modulus().value();
+
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        changed.wait(guard, [&] {
+            return stopping || ((masks.size() < capacity) && (running_queries == 0));
+        });
+        if (stopping) {
+            return;
+        }
+
+        // masks are made one at a time, without holding the lock, so that a
+        // query that starts in the meantime only waits for this one.
+        guard.unlock();
+        Plaintext mask;
+        random_mask(random, encoder, plain_modulus, mask);
+        evaluator.transform_to_ntt_inplace(mask, context->first_parms_id());
+        guard.lock();
+
+        if (masks.size() < capacity) {
+            masks.push_back(move(mask));
+        }
+        changed.notify_all();
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "seal/seal.h"
+
+#include "random.h"
+
+using namespace std;
+using namespace seal;
+
+/* sets `destination` to a batched plaintext with a uniformly random nonzero
+   value in every slot. */
+void random_mask(AESRandom &random, BatchEncoder &encoder, uint64_t plain_modulus, Plaintext &destination);
+
+/* MaskPool keeps up to `capacity` random masks (see random_mask) ready, in
+   NTT form for the first parms_id of `context`, so that masking a response
+   neither draws random values nor encodes anything.
+   a background thread refills the pool, but only while no query holds it
+   (between begin_query and end_query), so that refilling doesn't take CPU
+   time away from answering queries. */
+class MaskPool
+{
+public:
+    MaskPool(shared_ptr<SEALContext> context, size_t capacity);
+    ~MaskPool();
+
+    MaskPool(const MaskPool &) = delete;
+    MaskPool& operator=(const MaskPool &) = delete;
+
+    /* blocks until the pool is full. */
+    void wait_until_full();
+    void begin_query();
+    void end_query();
+    /* moves a mask into `destination` and returns true, or returns false if
+       the pool is empty. may be called from several threads at once. */
+    bool pop(Plaintext &destination);
+
+private:
+    void refill();
+
+    shared_ptr<SEALContext> context;
+    size_t capacity;
+    vector<Plaintext> masks;
+    size_t running_queries;
+    bool stopping;
+    mutex lock;
+    // notified whenever any of the above changes
+    condition_variable changed;
+    thread refiller;
+};
@@ -1,22 +1,53 @@
+#include <algorithm>
 #include <cassert>
+#include <stdexcept>
+#include <utility>
 
+#include "bitpacking.h"
 #include "networking.h"
+#include "seeded.h"
 
 const uint64_t NET_MAGIC_HELLO = 0x5052495643415453ull; // 'PRIVCATS'
 const uint32_t NET_MAGIC_VECTOR_UINT64 = 0x76756938ul; // 'vui8'
 const uint32_t NET_MAGIC_CIPHERTEXT = 0x63697074ul; // 'cipt'
 const uint32_t NET_MAGIC_VECTOR_CIPHERTEXT = 0x76636970ul; // 'vcip'
+const uint32_t NET_MAGIC_SEEDED_CIPHERTEXT = 0x73636970ul; // 'scip'
+const uint32_t NET_MAGIC_VECTOR_SEEDED_CIPHERTEXT = 0x76736369ul; // 'vsci'
+const uint32_t NET_MAGIC_PACKED_CIPHERTEXT = 0x70636970ul; // 'pcip'
+const uint32_t NET_MAGIC_VECTOR_PACKED_CIPHERTEXT = 0x76706369ul; // 'vpci'
 const uint32_t NET_MAGIC_PUBLIC_KEY = 0x706b6579ul; // 'pkey'
 const uint32_t NET_MAGIC_RELIN_KEYS = 0x72656c6eul; // 'reln'
+const uint32_t NET_MAGIC_SEEDED_PUBLIC_KEY = 0x73706b79ul; // 'spky'
+const uint32_t NET_MAGIC_SEEDED_RELIN_KEYS = 0x73726c6eul; // 'srln'
+
+/* SEAL assumes that every coefficient of a ciphertext is reduced modulo its
+   prime, so polynomials that come from the network are checked before use.
+   `poly` holds coeff_modulus.size() blocks of n coefficients. */
+static void check_reduced(const uint64_t *poly, const vector<SmallModulus> &coeff_modulus, size_t n)
+{
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+        uint64_t modulus = coeff_modulus[i].value();
+        for (size_t j = 0; j < n; j++) {
+            if (poly[i * n + j] >= modulus) {
+                throw runtime_error("received a coefficient that isn't reduced modulo its prime");
+            }
+        }
+    }
+}
 
 Networking::Networking(ip::tcp::socket &socket)
-    : socket(socket), read_stream(&read_buffer), write_stream(&write_buffer)
+    : socket(socket), read_stream(&read_buffer), write_stream(&write_buffer),
+      packed_polynomials(false)
 {}
 
 void Networking::set_seal_context(shared_ptr<SEALContext> new_context) {
     seal_context = new_context;
 }
 
+void Networking::set_packed_polynomials(bool new_value) {
+    packed_polynomials = new_value;
+}
+
 uint32_t Networking::read_uint32() {
     uint8_t bytes[4];
     auto transferred = read(socket, boost::asio::buffer(&bytes, 4));
@@ -49,7 +80,9 @@ void Networking::write_uint64(uint64_t value) {
 }
 
 void Networking::read_hello() {
-    assert(read_uint64() == NET_MAGIC_HELLO);
+    if (read_uint64() != NET_MAGIC_HELLO) {
+        throw runtime_error("expected a hello");
+    }
 }
 
 void Networking::write_hello() {
@@ -58,7 +91,9 @@ void Networking::write_hello() {
 
 void Networking::read_ciphertext(Ciphertext &ciphertext) {
     assert(seal_context);
-    assert(read_uint32() == NET_MAGIC_CIPHERTEXT);
+    if (read_uint32() != NET_MAGIC_CIPHERTEXT) {
+        throw runtime_error("expected a ciphertext");
+    }
     uint32_t length = read_uint32();
     auto transferred = read(socket, read_buffer, transfer_exactly(length));
     assert(transferred == length);
@@ -76,7 +111,9 @@ void Networking::write_ciphertext(Ciphertext &ciphertext) {
 }
 
 void Networking::read_uint64s(vector<uint64_t> &values) {
-    assert(read_uint32() == NET_MAGIC_VECTOR_UINT64);
+    if (read_uint32() != NET_MAGIC_VECTOR_UINT64) {
+        throw runtime_error("expected a vector of integers");
+    }
     uint32_t length = read_uint32();
     values.resize(length);
     for (size_t i = 0; i < length; i++) {
@@ -92,12 +129,212 @@ void Networking::write_uint64s(vector<uint64_t> &values) {
     }
 }
 
+void Networking::read_words(uint64_t *destination, size_t count) {
+    uint32_t length = read_uint32();
+    if (length != count * sizeof(uint64_t)) {
+        throw runtime_error("received a polynomial of the wrong size");
+    }
+    auto transferred = read(socket, boost::asio::buffer(destination, length));
+    assert(transferred == length);
+}
+
+void Networking::write_words(const uint64_t *source, size_t count) {
+    uint32_t length = count * sizeof(uint64_t);
+    write_uint32(length);
+    auto transferred = write(socket, boost::asio::buffer(source, length));
+    assert(transferred == length);
+}
+
+void Networking::read_polynomial(uint64_t *destination) {
+    assert(seal_context);
+    auto &parms = seal_context->first_context_data()->parms();
+    auto &coeff_modulus = parms.coeff_modulus();
+    size_t n = parms.poly_modulus_degree();
+
+    if (!packed_polynomials) {
+        read_words(destination, n * coeff_modulus.size());
+    } else {
+        size_t expected_length = 0;
+        for (size_t i = 0; i < coeff_modulus.size(); i++) {
+            expected_length += packed_size(n, coeff_modulus[i].bit_count());
+        }
+        uint32_t length = read_uint32();
+        if (length != expected_length) {
+            throw runtime_error("received a packed polynomial of the wrong length");
+        }
+        vector<uint8_t> packed(length);
+        auto transferred = read(socket, boost::asio::buffer(packed));
+        assert(transferred == length);
+
+        size_t offset = 0;
+        for (size_t i = 0; i < coeff_modulus.size(); i++) {
+            size_t bits = coeff_modulus[i].bit_count();
+            unpack_bits(packed.data() + offset, n, bits, destination + i * n);
+            offset += packed_size(n, bits);
+        }
+    }
+    check_reduced(destination, coeff_modulus, n);
+}
+
+void Networking::write_polynomial(const uint64_t *source) {
+    assert(seal_context);
+    auto &parms = seal_context->first_context_data()->parms();
+    auto &coeff_modulus = parms.coeff_modulus();
+    size_t n = parms.poly_modulus_degree();
+
+    if (!packed_polynomials) {
+        write_words(source, n * coeff_modulus.size());
+        return;
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+        length += packed_size(n, coeff_modulus[i].bit_count());
+    }
+    vector<uint8_t> packed(length);
+    size_t offset = 0;
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+        size_t bits = coeff_modulus[i].bit_count();
+        pack_bits(source + i * n, n, bits, packed.data() + offset);
+        offset += packed_size(n, bits);
+    }
+
+    write_uint32(length);
+    auto transferred = write(socket, boost::asio::buffer(packed));
+    assert(transferred == length);
+}
+
+void Networking::read_seeded_ciphertext(Ciphertext &ciphertext) {
+    assert(seal_context);
+    if (read_uint32() != NET_MAGIC_SEEDED_CIPHERTEXT) {
+        throw runtime_error("expected a seeded ciphertext");
+    }
+    pair<uint64_t, uint64_t> seed;
+    seed.first = read_uint64();
+    seed.second = read_uint64();
+
+    // seeded ciphertexts are always at the first parms_id, so that is the
+    // only size and set of primes c0 can have.
+    auto &parms = seal_context->first_context_data()->parms();
+    vector<uint64_t> c0(parms.poly_modulus_degree() * parms.coeff_modulus().size());
+    read_polynomial(c0.data());
+
+    expand_seeded_ciphertext(seal_context, seed, ciphertext);
+    copy(c0.begin(), c0.end(), ciphertext.data(0));
+}
+
+void Networking::write_seeded_ciphertext(Ciphertext &ciphertext, pair<uint64_t, uint64_t> seed) {
+    assert(ciphertext.size() == 2);
+    write_uint32(NET_MAGIC_SEEDED_CIPHERTEXT);
+    write_uint64(seed.first);
+    write_uint64(seed.second);
+    write_polynomial(ciphertext.data(0));
+}
+
+void Networking::read_packed_ciphertext(Ciphertext &ciphertext) {
+    assert(seal_context);
+    if (read_uint32() != NET_MAGIC_PACKED_CIPHERTEXT) {
+        throw runtime_error("expected a packed ciphertext");
+    }
+    parms_id_type parms_id;
+    for (auto &word : parms_id) {
+        word = read_uint64();
+    }
+    uint32_t size = read_uint32();
+    bool is_ntt_form = (read_uint32() != 0);
+
+    // the protocol only ever sends ciphertexts of size 2, at a level of
+    // the context.
+    auto context_data = seal_context->context_data(parms_id);
+    if (!context_data) {
+        throw runtime_error("received a ciphertext with an unknown parms_id");
+    }
+    if (size != 2) {
+        throw runtime_error("received a ciphertext of the wrong size");
+    }
+    auto &coeff_modulus = context_data->parms().coeff_modulus();
+    size_t n = context_data->parms().poly_modulus_degree();
+
+    size_t expected_length = 0;
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+        expected_length += size * packed_size(n, coeff_modulus[i].bit_count());
+    }
+    uint32_t length = read_uint32();
+    if (length != expected_length) {
+        throw runtime_error("received a packed ciphertext of the wrong length");
+    }
+    vector<uint8_t> packed(length);
+    auto transferred = read(socket, boost::asio::buffer(packed));
+    assert(transferred == length);
+
+    ciphertext.resize(seal_context, parms_id, size);
+    ciphertext.is_ntt_form() = is_ntt_form;
+    size_t offset = 0;
+    for (size_t poly = 0; poly < size; poly++) {
+        for (size_t i = 0; i < coeff_modulus.size(); i++) {
+            size_t bits = coeff_modulus[i].bit_count();
+            unpack_bits(packed.data() + offset, n, bits, ciphertext.data(poly) + i * n);
+            offset += packed_size(n, bits);
+        }
+        // a prime's bit width fits values up to 2^bits - 1, not just up to
+        // the prime.
+        check_reduced(ciphertext.data(poly), coeff_modulus, n);
+    }
+}
+
+void Networking::write_packed_ciphertext(Ciphertext &ciphertext) {
+    assert(seal_context);
+    auto context_data = seal_context->context_data(ciphertext.parms_id());
+    assert(context_data);
+    auto &coeff_modulus = context_data->parms().coeff_modulus();
+    size_t n = context_data->parms().poly_modulus_degree();
+
+    write_uint32(NET_MAGIC_PACKED_CIPHERTEXT);
+    for (auto word : ciphertext.parms_id()) {
+        write_uint64(word);
+    }
+    write_uint32(ciphertext.size());
+    write_uint32(ciphertext.is_ntt_form() ? 1 : 0);
+
+    size_t length = 0;
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+        length += ciphertext.size() * packed_size(n, coeff_modulus[i].bit_count());
+    }
+    vector<uint8_t> packed(length);
+    size_t offset = 0;
+    for (size_t poly = 0; poly < ciphertext.size(); poly++) {
+        for (size_t i = 0; i < coeff_modulus.size(); i++) {
+            size_t bits = coeff_modulus[i].bit_count();
+            pack_bits(ciphertext.data(poly) + i * n, n, bits, packed.data() + offset);
+            offset += packed_size(n, bits);
+        }
+    }
+
+    write_uint32(length);
+    auto transferred = write(socket, boost::asio::buffer(packed));
+    assert(transferred == length);
+}
+
 void Networking::read_ciphertexts(vector<Ciphertext> &ciphertexts) {
-    assert(read_uint32() == NET_MAGIC_VECTOR_CIPHERTEXT);
+    uint32_t magic = read_uint32();
+    if ((magic != NET_MAGIC_VECTOR_CIPHERTEXT)
+        && (magic != NET_MAGIC_VECTOR_SEEDED_CIPHERTEXT)
+        && (magic != NET_MAGIC_VECTOR_PACKED_CIPHERTEXT)) {
+        throw runtime_error("expected a vector of ciphertexts");
+    }
     uint32_t length = read_uint32();
-    ciphertexts.resize(length);
+    // the length comes from the peer, so we only make room for ciphertexts
+    // that actually arrive.
+    ciphertexts.clear();
     for (size_t i = 0; i < length; i++) {
-        read_ciphertext(ciphertexts[i]);
+        ciphertexts.emplace_back();
+        if (magic == NET_MAGIC_VECTOR_SEEDED_CIPHERTEXT) {
+            read_seeded_ciphertext(ciphertexts.back());
+        } else if (magic == NET_MAGIC_VECTOR_PACKED_CIPHERTEXT) {
+            read_packed_ciphertext(ciphertexts.back());
+        } else {
+            read_ciphertext(ciphertexts.back());
+        }
     }
 }
 
@@ -109,9 +346,45 @@ void Networking::write_ciphertexts(vector<Ciphertext> &ciphertexts) {
     }
 }
 
+void Networking::write_packed_ciphertexts(vector<Ciphertext> &ciphertexts) {
+    write_uint32(NET_MAGIC_VECTOR_PACKED_CIPHERTEXT);
+    write_uint32(ciphertexts.size());
+    for (size_t i = 0; i < ciphertexts.size(); i++) {
+        write_packed_ciphertext(ciphertexts[i]);
+    }
+}
+
+void Networking::write_seeded_ciphertexts(vector<Ciphertext> &ciphertexts, vector<pair<uint64_t, uint64_t>> &seeds) {
+    assert(ciphertexts.size() == seeds.size());
+    write_uint32(NET_MAGIC_VECTOR_SEEDED_CIPHERTEXT);
+    write_uint32(ciphertexts.size());
+    for (size_t i = 0; i < ciphertexts.size(); i++) {
+        write_seeded_ciphertext(ciphertexts[i], seeds[i]);
+    }
+}
+
 void Networking::read_public_key(PublicKey &public_key) {
     assert(seal_context);
-    assert(read_uint32() == NET_MAGIC_PUBLIC_KEY);
+    uint32_t magic = read_uint32();
+    if ((magic != NET_MAGIC_PUBLIC_KEY) && (magic != NET_MAGIC_SEEDED_PUBLIC_KEY)) {
+        throw runtime_error("expected a public key");
+    }
+    if (magic == NET_MAGIC_SEEDED_PUBLIC_KEY) {
+        pair<uint64_t, uint64_t> seed;
+        seed.first = read_uint64();
+        seed.second = read_uint64();
+
+        // keys are always at the first parms_id, in NTT form
+        Ciphertext &key = public_key.data();
+        public_key.parms_id() = seal_context->first_parms_id();
+        key.resize(seal_context, seal_context->first_parms_id(), 2);
+        key.is_ntt_form() = true;
+        read_polynomial(key.data(0));
+        AESRandom expander(seed.first, seed.second);
+        expand_key_ciphertext(seal_context, expander, key);
+        return;
+    }
+
     uint32_t length = read_uint32();
     auto transferred = read(socket, read_buffer, transfer_exactly(length));
     assert(transferred == length);
@@ -128,16 +401,67 @@ void Networking::write_public_key(PublicKey &public_key) {
     write_buffer.consume(length);
 }
 
+void Networking::write_seeded_public_key(PublicKey &public_key, pair<uint64_t, uint64_t> seed) {
+    Ciphertext &key = public_key.data();
+    write_uint32(NET_MAGIC_SEEDED_PUBLIC_KEY);
+    write_uint64(seed.first);
+    write_uint64(seed.second);
+    write_polynomial(key.data(0));
+}
+
 void Networking::read_relin_keys(RelinKeys &relin_keys) {
     assert(seal_context);
-    assert(read_uint32() == NET_MAGIC_RELIN_KEYS);
+    uint32_t magic = read_uint32();
+    if ((magic != NET_MAGIC_RELIN_KEYS) && (magic != NET_MAGIC_SEEDED_RELIN_KEYS)) {
+        throw runtime_error("expected relinearization keys");
+    }
+    pair<uint64_t, uint64_t> seed;
+    if (magic == NET_MAGIC_SEEDED_RELIN_KEYS) {
+        seed.first = read_uint64();
+        seed.second = read_uint64();
+    }
     uint32_t length = read_uint32();
     auto transferred = read(socket, read_buffer, transfer_exactly(length));
     assert(transferred == length);
-    relin_keys.load(seal_context, read_stream);
+    if (magic == NET_MAGIC_RELIN_KEYS) {
+        relin_keys.load(seal_context, read_stream);
+        return;
+    }
+
+    // the keys were saved without their ciphertexts, which can't pass
+    // SEAL's validity checks, so they are loaded unchecked and then filled
+    // in, in the order in which they were reseeded.
+    relin_keys.unsafe_load(read_stream);
+    relin_keys.parms_id() = seal_context->first_parms_id();
+    int dbc = relin_keys.decomposition_bit_count();
+    if ((relin_keys.size() == 0) || (dbc < SEAL_DBC_MIN) || (dbc > SEAL_DBC_MAX)) {
+        throw runtime_error("received invalid relinearization keys");
+    }
+
+    // like SEAL's key generator, every key has one ciphertext per
+    // dbc-bit digit of every prime.
+    auto &coeff_modulus = seal_context->first_context_data()->parms().coeff_modulus();
+    size_t decomposition_count = 0;
+    for (auto &modulus : coeff_modulus) {
+        decomposition_count += (modulus.bit_count() + dbc - 1) / dbc;
+    }
+
+    AESRandom expander(seed.first, seed.second);
+    for (auto &key : relin_keys.data()) {
+        if (read_uint32() != decomposition_count) {
+            throw runtime_error("received a relinearization key with the wrong number of ciphertexts");
+        }
+        key.resize(decomposition_count);
+        for (auto &ciphertext : key) {
+            ciphertext.resize(seal_context, seal_context->first_parms_id(), 2);
+            ciphertext.is_ntt_form() = true;
+            read_polynomial(ciphertext.data(0));
+            expand_key_ciphertext(seal_context, expander, ciphertext);
+        }
+    }
 }
 
-void Networking::write_relin_keys(RelinKeys relin_keys) {
+void Networking::write_relin_keys(RelinKeys &relin_keys) {
     write_uint32(NET_MAGIC_RELIN_KEYS);
     relin_keys.save(write_stream);
     uint32_t length = write_buffer.size();
@@ -146,3 +470,36 @@ void Networking::write_relin_keys(RelinKeys relin_keys) {
     assert(transferred == length);
     write_buffer.consume(length);
 }
+
+void Networking::write_seeded_relin_keys(RelinKeys &relin_keys, pair<uint64_t, uint64_t> seed) {
+    write_uint32(NET_MAGIC_SEEDED_RELIN_KEYS);
+    write_uint64(seed.first);
+    write_uint64(seed.second);
+
+    // SEAL's serialization of the keys without their ciphertexts carries the
+    // rest of their metadata, like the decomposition bit count. SEAL has no
+    // setter for that, so instead of copying the keys into an empty skeleton,
+    // we move their ciphertexts out while we save them, and then back.
+    vector<vector<Ciphertext>> ciphertexts = move(relin_keys.data());
+    relin_keys.data().clear();
+    relin_keys.data().resize(ciphertexts.size());
+    try {
+        relin_keys.save(write_stream);
+    } catch (...) {
+        relin_keys.data() = move(ciphertexts);
+        throw;
+    }
+    relin_keys.data() = move(ciphertexts);
+    uint32_t length = write_buffer.size();
+    write_uint32(length);
+    auto transferred = write(socket, write_buffer, transfer_exactly(length));
+    assert(transferred == length);
+    write_buffer.consume(length);
+
+    for (auto &key : relin_keys.data()) {
+        write_uint32(key.size());
+        for (auto &ciphertext : key) {
+            write_polynomial(ciphertext.data(0));
+        }
+    }
+}
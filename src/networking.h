@@ -11,12 +11,30 @@
 using namespace std;
 using namespace boost::asio;
 
+// the bits of the mode that the sender announces after its seeds
+// the receiver sends all powers instead of relinearization keys
+const uint32_t NET_MODE_RELIN_FREE = 1;
+// the sender accepts seeded query ciphertexts (see write_seeded_ciphertexts)
+const uint32_t NET_MODE_SEEDED_QUERIES = 2;
+// the sender accepts seeded keys (see write_seeded_public_key and
+// write_seeded_relin_keys)
+const uint32_t NET_MODE_SEEDED_KEYS = 4;
+// both sides send whole ciphertexts (queries that aren't seeded, and the
+// responses) bit-packed (see write_packed_ciphertexts), and the polynomials
+// that seeded ciphertexts and keys carry too (see set_packed_polynomials)
+const uint32_t NET_MODE_PACKED_CIPHERTEXTS = 8;
+
 class Networking
 {
 public:
     Networking(ip::tcp::socket &socket);
 
     void set_seal_context(shared_ptr<SEALContext> new_context);
+    /* if set, the c0 of seeded ciphertexts and keys is bit-packed like in
+       write_packed_ciphertexts instead of sent as 64-bit words. both sides
+       must agree on it, since those formats don't say which one they use.
+       off by default. */
+    void set_packed_polynomials(bool new_value);
 
     uint32_t read_uint32();
     void write_uint32(uint32_t value);
@@ -33,16 +51,55 @@ public:
     void read_ciphertext(Ciphertext &ciphertext);
     void write_ciphertext(Ciphertext &ciphertext);
 
+    /* reads ciphertexts written with write_ciphertexts,
+       write_seeded_ciphertexts or write_packed_ciphertexts. */
     void read_ciphertexts(vector<Ciphertext> &ciphertexts);
     void write_ciphertexts(vector<Ciphertext> &ciphertexts);
 
+    /* writes fresh seeded ciphertexts (see seeded.h) as their seed and c0
+       only. seeds[i] must be the seed of ciphertexts[i]. */
+    void write_seeded_ciphertexts(vector<Ciphertext> &ciphertexts, vector<pair<uint64_t, uint64_t>> &seeds);
+
+    /* writes ciphertexts with each coefficient packed to the bit width of its
+       prime (see pack_bits), instead of a 64-bit word. */
+    void write_packed_ciphertexts(vector<Ciphertext> &ciphertexts);
+
+    /* reads a public key written with either write_public_key or
+       write_seeded_public_key. throws if the key isn't valid: SEAL's
+       invalid_argument for the former, runtime_error otherwise. */
     void read_public_key(PublicKey &public_key);
     void write_public_key(PublicKey &public_key);
+    /* writes a public key whose c1 is expanded from `seed` (see
+       reseed_key_ciphertext) as just the seed and c0. */
+    void write_seeded_public_key(PublicKey &public_key, pair<uint64_t, uint64_t> seed);
 
+    /* reads relinearization keys written with either write_relin_keys or
+       write_seeded_relin_keys, and throws like read_public_key. */
     void read_relin_keys(RelinKeys &relin_keys);
-    void write_relin_keys(RelinKeys relin_keys);
+    void write_relin_keys(RelinKeys &relin_keys);
+    /* like write_seeded_public_key, for relinearization keys whose
+       ciphertexts' c1 are all expanded from `seed`, in order. the keys are
+       left as they were, but are briefly emptied while they're written. */
+    void write_seeded_relin_keys(RelinKeys &relin_keys, pair<uint64_t, uint64_t> seed);
 
 private:
+    /* reads or writes `count` raw words, e.g. one polynomial of a ciphertext.
+       like SEAL's serialization, this is not endianness-aware. */
+    void read_words(uint64_t *destination, size_t count);
+    void write_words(const uint64_t *source, size_t count);
+
+    /* reads or writes the c0 of a seeded ciphertext or key, at the first
+       parms_id, packed or not depending on set_packed_polynomials. reading
+       throws runtime_error if the polynomial isn't valid. */
+    void read_polynomial(uint64_t *destination);
+    void write_polynomial(const uint64_t *source);
+
+    void read_packed_ciphertext(Ciphertext &ciphertext);
+    void write_packed_ciphertext(Ciphertext &ciphertext);
+
+    void read_seeded_ciphertext(Ciphertext &ciphertext);
+    void write_seeded_ciphertext(Ciphertext &ciphertext, pair<uint64_t, uint64_t> seed);
+
     ip::tcp::socket &socket;
     boost::asio::streambuf read_buffer;
     std::istream read_stream;
@@ -50,4 +107,5 @@ private:
     std::ostream write_stream;
 
     shared_ptr<SEALContext> seal_context;
+    bool packed_polynomials;
 };
@@ -1,53 +1,391 @@
+#include <algorithm>
 #include <cassert>
 #include <set>
 
 #include "polynomials.h"
 
+// below these sizes, the quadratic algorithms are faster than the
+// subquadratic ones (these are rough crossover points, not carefully tuned).
+const size_t NTT_MULTIPLY_THRESHOLD = 32;
+const size_t POLYNOMIAL_DIVIDE_THRESHOLD = 64;
+const size_t PRODUCT_TREE_THRESHOLD = 128;
+const size_t FAST_INTERPOLATION_THRESHOLD = 256;
+// ranges of at most this many points are leaves of a subproduct tree.
+const size_t SUBPRODUCT_TREE_LEAF_SIZE = 32;
+// how many candidates to try before giving up on finding a root of unity
+const uint64_t ROOT_OF_UNITY_CANDIDATES = 1024;
+
+const uint32_t *modinv_table_65537() {
+    // with p = q * x + r, 0 = q * x + r mod p, so x^-1 = -q * r^-1 mod p
+    static const vector<uint32_t> table = []() {
+        const uint64_t p = 65537;
+        vector<uint32_t> inverses(p);
+        inverses[1] = 1;
+        for (uint64_t x = 2; x < p; x++) {
+            inverses[x] = (uint32_t) (((p - p / x) * inverses[p % x]) % p);
+        }
+        return inverses;
+    }();
+    return table.data();
+}
+
 uint64_t modexp(uint64_t base, uint64_t exponent, uint64_t modulus) {
-    uint64_t result = 1;
-    while (exponent > 0) {
-        if (exponent & 1) {
-            result = MUL_MOD(result, base, modulus);
+    return with_modulus(modulus, [&](auto fixed) {
+        return fixed.pow(base % fixed, exponent);
+    });
+}
+
+uint64_t modinv(uint64_t x, uint64_t modulus) {
+    return with_modulus(modulus, [&](auto fixed) {
+        return fixed.inverse(x % fixed);
+    });
+}
+
+/* replaces every element of values with its inverse mod modulus, using
+   Montgomery's trick: one modinv and 3 * (n - 1) multiplications in total.
+   all values must be nonzero. */
+template <typename Modulus>
+void batch_modinv(vector<uint64_t> &values, const Modulus &modulus) {
+    if (values.empty()) {
+        return;
+    }
+
+    // prefix[i] = values[0] * ... * values[i]
+    vector<uint64_t> prefix(values.size());
+    prefix[0] = values[0];
+    for (size_t i = 1; i < values.size(); i++) {
+        prefix[i] = modulus.mul(prefix[i - 1], values[i]);
+    }
+
+    uint64_t inverse = modulus.inverse(prefix.back());
+    for (size_t i = values.size() - 1; i > 0; i--) {
+        // inverse = (values[0] * ... * values[i])^-1
+        uint64_t value_inverse = modulus.mul(inverse, prefix[i - 1]);
+        inverse = modulus.mul(inverse, values[i]);
+        values[i] = value_inverse;
+    }
+    values[0] = inverse;
+}
+
+/* finds a primitive `length`th root of unity mod a prime modulus, where length
+   is a power of two. returns false if it can't find one, e.g. if length does
+   not divide modulus - 1. */
+template <typename Modulus>
+bool find_root_of_unity(size_t length, const Modulus &modulus, uint64_t &root) {
+    if ((modulus - 1) % length != 0) {
+        return false;
+    }
+    if (length == 1) {
+        root = 1;
+        return true;
+    }
+
+    // for any x, x^((p - 1) / length) is a length-th root of unity. it is a
+    // primitive one unless its (length / 2)th power is 1, which happens for
+    // half of all x at most, so this loop ends quickly.
+    for (uint64_t x = 2; (x < modulus) && (x < ROOT_OF_UNITY_CANDIDATES); x++) {
+        root = modulus.pow(x, (modulus - 1) / length);
+        if (modulus.pow(root, length / 2) == modulus - 1) {
+            return true;
         }
-        base = MUL_MOD(base, base, modulus);
-        exponent = (exponent >> 1);
     }
-    return result;
+    return false;
 }
 
-uint64_t modinv(uint64_t x, uint64_t modulus) {
-    return modexp(x, modulus - 2, modulus);
+/* in-place iterative Cooley-Tukey NTT of a (whose size is a power of two)
+   mod modulus, using the primitive a.size()-th root of unity `root`. */
+template <typename Modulus>
+void ntt_transform(vector<uint64_t> &a, uint64_t root, const Modulus &modulus) {
+    size_t n = a.size();
+
+    // bit-reversal permutation
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            swap(a[i], a[j]);
+        }
+    }
+
+    vector<uint64_t> twiddles(n / 2);
+    for (size_t length = 2; length <= n; length <<= 1) {
+        size_t half = length / 2;
+        uint64_t step = modulus.pow(root, n / length);
+        twiddles[0] = 1;
+        for (size_t j = 1; j < half; j++) {
+            twiddles[j] = modulus.mul(twiddles[j - 1], step);
+        }
+
+        for (size_t i = 0; i < n; i += length) {
+            for (size_t j = 0; j < half; j++) {
+                uint64_t u = a[i + j];
+                uint64_t v = modulus.mul(a[i + j + half], twiddles[j]);
+                a[i + j] = (u + v) % modulus;
+                a[i + j + half] = (u + modulus - v) % modulus;
+            }
+        }
+    }
 }
 
-void polynomial_from_roots(vector<uint64_t> &roots, vector<uint64_t> &coeffs, uint64_t modulus) {
+template <typename Modulus>
+void polynomial_multiply(const vector<uint64_t> &a,
+                         const vector<uint64_t> &b,
+                         vector<uint64_t> &result,
+                         const Modulus &modulus)
+{
+    if (a.empty() || b.empty()) {
+        result.clear();
+        return;
+    }
+
+    size_t result_size = a.size() + b.size() - 1;
+    size_t length = 1;
+    while (length < result_size) {
+        length <<= 1;
+    }
+
+    uint64_t root;
+    if ((min(a.size(), b.size()) <= NTT_MULTIPLY_THRESHOLD)
+        || !find_root_of_unity(length, modulus, root)) {
+        // schoolbook multiplication
+        vector<uint64_t> product(result_size, 0);
+        for (size_t i = 0; i < a.size(); i++) {
+            for (size_t j = 0; j < b.size(); j++) {
+                product[i + j] = (product[i + j] + modulus.mul(a[i], b[j])) % modulus;
+            }
+        }
+        result = move(product);
+        return;
+    }
+
+    vector<uint64_t> a_ntt(length, 0), b_ntt(length, 0);
+    copy(a.begin(), a.end(), a_ntt.begin());
+    copy(b.begin(), b.end(), b_ntt.begin());
+    ntt_transform(a_ntt, root, modulus);
+    ntt_transform(b_ntt, root, modulus);
+    for (size_t i = 0; i < length; i++) {
+        a_ntt[i] = modulus.mul(a_ntt[i], b_ntt[i]);
+    }
+
+    // the inverse NTT is the NTT with the inverse root, divided by length.
+    ntt_transform(a_ntt, modulus.inverse(root), modulus);
+    uint64_t length_inverse = modulus.inverse(length % modulus);
+    result.resize(result_size);
+    for (size_t i = 0; i < result_size; i++) {
+        result[i] = modulus.mul(a_ntt[i], length_inverse);
+    }
+}
+
+/* computes the inverse of f mod x^k by Newton iteration, f[0] must be 1. */
+template <typename Modulus>
+void polynomial_inverse_series(const vector<uint64_t> &f,
+                               size_t k,
+                               vector<uint64_t> &inverse,
+                               const Modulus &modulus)
+{
+    assert(!f.empty() && (f[0] == 1));
+    inverse.assign(1, 1);
+    vector<uint64_t> f_low, correction;
+
+    // if g = f^-1 mod x^l, then g * (2 - f * g) = f^-1 mod x^{2l}
+    for (size_t l = 1; l < k; ) {
+        size_t next_l = min(2 * l, k);
+        f_low.assign(f.begin(), f.begin() + min(f.size(), next_l));
+        polynomial_multiply(f_low, inverse, correction, modulus);
+        correction.resize(next_l, 0);
+        for (size_t i = 0; i < next_l; i++) {
+            correction[i] = (modulus - correction[i]) % modulus;
+        }
+        correction[0] = (correction[0] + 2) % modulus;
+        polynomial_multiply(inverse, correction, inverse, modulus);
+        inverse.resize(next_l);
+        l = next_l;
+    }
+}
+
+/* computes a mod b, where b is monic. */
+template <typename Modulus>
+void polynomial_remainder(const vector<uint64_t> &a,
+                          const vector<uint64_t> &b,
+                          vector<uint64_t> &remainder,
+                          const Modulus &modulus)
+{
+    assert(!b.empty() && (b.back() == 1));
+    size_t b_degree = b.size() - 1;
+    if (a.size() <= b_degree) {
+        remainder = a;
+        return;
+    }
+    size_t quotient_size = a.size() - b_degree;
+
+    if ((quotient_size <= POLYNOMIAL_DIVIDE_THRESHOLD) || (b_degree <= POLYNOMIAL_DIVIDE_THRESHOLD)) {
+        // schoolbook long division
+        remainder = a;
+        for (size_t i = a.size() - 1; i >= b_degree; i--) {
+            uint64_t factor = remainder[i];
+            if (factor != 0) {
+                for (size_t j = 0; j <= b_degree; j++) {
+                    size_t index = i - b_degree + j;
+                    remainder[index] = (remainder[index] + modulus - modulus.mul(factor, b[j])) % modulus;
+                }
+            }
+            if (i == b_degree) {
+                break;
+            }
+        }
+        remainder.resize(b_degree);
+        return;
+    }
+
+    // with rev(p) denoting the coefficients of p in reverse order, the
+    // quotient q satisfies rev(q) = rev(a) * rev(b)^-1 mod x^quotient_size.
+    vector<uint64_t> a_reversed(a.rbegin(), a.rbegin() + quotient_size);
+    vector<uint64_t> b_reversed(b.rbegin(), b.rend());
+    vector<uint64_t> b_reversed_inverse, quotient, product;
+    polynomial_inverse_series(b_reversed, quotient_size, b_reversed_inverse, modulus);
+    polynomial_multiply(a_reversed, b_reversed_inverse, quotient, modulus);
+    quotient.resize(quotient_size);
+    reverse(quotient.begin(), quotient.end());
+
+    // remainder = a - q * b, which only has b_degree nonzero coefficients.
+    polynomial_multiply(quotient, b, product, modulus);
+    remainder.resize(b_degree);
+    for (size_t i = 0; i < b_degree; i++) {
+        remainder[i] = (a[i] + modulus - product[i]) % modulus;
+    }
+}
+
+/* quadratic version of polynomial_from_roots. */
+template <typename Modulus>
+void polynomial_from_roots_quadratic(const vector<uint64_t> &roots,
+                                     size_t begin,
+                                     size_t end,
+                                     vector<uint64_t> &coeffs,
+                                     const Modulus &modulus)
+{
     coeffs.clear();
-    coeffs.resize(roots.size() + 1);
+    coeffs.resize(end - begin + 1);
     coeffs[0] = 1;
 
-    for (size_t i = 0; i < roots.size(); i++) {
+    for (size_t i = 0; i < end - begin; i++) {
         // multiply coeffs by (x - root)
-        uint64_t neg_root = modulus - (roots[i] % modulus);
+        uint64_t neg_root = modulus - (roots[begin + i] % modulus);
 
         for (size_t j = i + 1; j > 0; j--) {
-            coeffs[j] = (coeffs[j - 1] + MUL_MOD(neg_root, coeffs[j], modulus)) % modulus;
+            coeffs[j] = (coeffs[j - 1] + modulus.mul(neg_root, coeffs[j])) % modulus;
         }
-        coeffs[0] = MUL_MOD(coeffs[0], neg_root, modulus);
+        coeffs[0] = modulus.mul(coeffs[0], neg_root);
     }
 }
 
-void polynomial_from_points(vector<uint64_t> &xs,
-                            vector<uint64_t> &ys,
-                            vector<uint64_t> &coeffs,
-                            uint64_t modulus)
+/* computes the product of (x - roots[i]) for begin <= i < end by splitting the
+   range in half and multiplying the two halves' products. */
+template <typename Modulus>
+void polynomial_from_roots_range(const vector<uint64_t> &roots,
+                                 size_t begin,
+                                 size_t end,
+                                 vector<uint64_t> &coeffs,
+                                 const Modulus &modulus)
 {
-    assert(xs.size() == ys.size());
-    coeffs.clear();
-    coeffs.resize(xs.size());
-
-    if (xs.size() == 0) {
+    if (end - begin <= PRODUCT_TREE_THRESHOLD) {
+        polynomial_from_roots_quadratic(roots, begin, end, coeffs, modulus);
         return;
     }
 
+    size_t middle = begin + (end - begin) / 2;
+    vector<uint64_t> left, right;
+    polynomial_from_roots_range(roots, begin, middle, left, modulus);
+    polynomial_from_roots_range(roots, middle, end, right, modulus);
+    polynomial_multiply(left, right, coeffs, modulus);
+}
+
+template <typename Modulus>
+void polynomial_from_roots(vector<uint64_t> &roots, vector<uint64_t> &coeffs, const Modulus &modulus) {
+    polynomial_from_roots_range(roots, 0, roots.size(), coeffs, modulus);
+}
+
+template <typename Modulus>
+void polynomial_replace_root(vector<uint64_t> &coeffs,
+                             uint64_t old_root,
+                             uint64_t new_root,
+                             const Modulus &modulus)
+{
+    assert(coeffs.size() >= 2);
+    size_t degree = coeffs.size() - 1;
+    old_root %= modulus;
+    uint64_t neg_new_root = modulus - (new_root % modulus);
+
+    // synthetic division by (x - old_root) produces the quotient q from the
+    // top down: q[i - 1] = coeffs[i] + old_root * q[i], with
+    // q[degree - 1] = coeffs[degree]. as soon as we know q[i - 1] and q[i], we
+    // can overwrite coeffs[i] with the ith coefficient of q(x) * (x - new_root),
+    // which is q[i - 1] - new_root * q[i].
+    uint64_t q = coeffs[degree];
+    for (size_t i = degree - 1; i > 0; i--) {
+        uint64_t q_next = (coeffs[i] + modulus.mul(old_root, q)) % modulus;
+        coeffs[i] = (q_next + modulus.mul(neg_new_root, q)) % modulus;
+        q = q_next;
+    }
+    // the remainder of the division must be zero
+    assert((coeffs[0] + modulus.mul(old_root, q)) % modulus == 0);
+    coeffs[0] = modulus.mul(neg_new_root, q);
+}
+
+template <typename Modulus>
+void polynomial_remove_point(vector<uint64_t> &coeffs,
+                             const vector<uint64_t> &others,
+                             const Modulus &modulus)
+{
+    size_t count = others.size() - 1;
+    assert(coeffs.size() >= others.size());
+    assert(others[count] == 1);
+
+    // the old and the new polynomial agree on the other points, so their
+    // difference is a multiple of `others`. the new one has a lower degree,
+    // so the multiple is the old one's top coefficient.
+    uint64_t neg_top = (modulus - coeffs[count]) % modulus;
+    for (size_t i = 0; i <= count; i++) {
+        coeffs[i] = (coeffs[i] + modulus.mul(neg_top, others[i])) % modulus;
+    }
+}
+
+template <typename Modulus>
+void polynomial_add_point(vector<uint64_t> &coeffs,
+                          const vector<uint64_t> &others,
+                          uint64_t x,
+                          uint64_t y,
+                          const Modulus &modulus)
+{
+    size_t count = others.size() - 1;
+    assert(coeffs.size() >= others.size());
+    x %= modulus;
+
+    // Lagrange: adding a multiple of `others` doesn't change the values at
+    // the other points, so we pick the one that makes the value at x right.
+    uint64_t value = 0, others_value = 0;
+    for (size_t i = count + 1; i > 0; i--) {
+        value = (modulus.mul(value, x) + coeffs[i - 1]) % modulus;
+        others_value = (modulus.mul(others_value, x) + others[i - 1]) % modulus;
+    }
+    assert(others_value != 0);
+    uint64_t factor = modulus.mul((y % modulus + modulus - value) % modulus,
+                                  modulus.inverse(others_value));
+    for (size_t i = 0; i <= count; i++) {
+        coeffs[i] = (coeffs[i] + modulus.mul(factor, others[i])) % modulus;
+    }
+}
+
+/* quadratic version of polynomial_from_points, using Newton's divided
+   differences. */
+template <typename Modulus>
+void polynomial_from_points_quadratic(vector<uint64_t> &xs,
+                                      vector<uint64_t> &ys,
+                                      vector<uint64_t> &coeffs,
+                                      const Modulus &modulus)
+{
     // at iteration i of the loop, basis contains the coefficients of the basis
     // polynomial (x - xs[0]) * (x - xs[1]) * ... * (x - xs[i - 1])
     vector<uint64_t> basis(xs.size());
@@ -57,10 +395,11 @@ void polynomial_from_points(vector<uint64_t> &xs,
     // [ys[j], ys[j + 1], ..., ys[j + i]]. thus initially, when i = 0,
     // ddif[j] = [ys[j]] = ys[j]
     vector<uint64_t> ddif = ys;
+    vector<uint64_t> dens(xs.size());
 
     for (size_t i = 0; i < xs.size(); i++) {
         for (size_t j = 0; j < i + 1; j++) {
-            coeffs[j] = (coeffs[j] + MUL_MOD(ddif[0], basis[j], modulus)) % modulus;
+            coeffs[j] = (coeffs[j] + modulus.mul(ddif[0], basis[j])) % modulus;
         }
 
         if (i < xs.size() - 1) {
@@ -68,17 +407,601 @@ void polynomial_from_points(vector<uint64_t> &xs,
             uint64_t neg_x = modulus - (xs[i] % modulus);
 
             for (size_t j = i + 1; j > 0; j--) {
-                basis[j] = (basis[j - 1] + MUL_MOD(neg_x, basis[j], modulus)) % modulus;
+                basis[j] = (basis[j - 1] + modulus.mul(neg_x, basis[j])) % modulus;
             }
-            basis[0] = MUL_MOD(basis[0], neg_x, modulus);
+            basis[0] = modulus.mul(basis[0], neg_x);
 
-            // update ddif: compute length-(i + 1) divided differences
-            for (size_t j = 0; j + i + 1 < xs.size() + 1; j++) {
+            // update ddif: compute length-(i + 1) divided differences. all
+            // denominators of this round are inverted at once.
+            size_t count = xs.size() - i - 1;
+            dens.resize(count);
+            for (size_t j = 0; j < count; j++) {
+                dens[j] = (xs[j + i + 1] - xs[j] + modulus) % modulus;
+            }
+            batch_modinv(dens, modulus);
+            for (size_t j = 0; j < count; j++) {
                 // dd_{j,j+i+1} = (dd_{j+1, j+i+1} - dd_{j, j+i}) / (x_{j+i+1} - x_j)
                 uint64_t num = (ddif[j + 1] - ddif[j] + modulus) % modulus;
-                uint64_t den = (xs[j + i + 1] - xs[j] + modulus) % modulus;
-                ddif[j] = MUL_MOD(num, modinv(den, modulus), modulus);
+                ddif[j] = modulus.mul(num, dens[j]);
+            }
+        }
+    }
+}
+
+/* a subproduct tree over a range of points: the node for a range holds the
+   product of (x - xs[i]) over the range, and its children split the range in
+   half. nodes are numbered like in a binary heap (the children of node k are
+   2k + 1 and 2k + 2), and ranges of at most SUBPRODUCT_TREE_LEAF_SIZE points
+   are leaves. */
+template <typename Modulus>
+void build_subproduct_tree(const vector<uint64_t> &xs,
+                           size_t begin,
+                           size_t end,
+                           size_t node,
+                           vector<vector<uint64_t>> &tree,
+                           const Modulus &modulus)
+{
+    if (end - begin <= SUBPRODUCT_TREE_LEAF_SIZE) {
+        polynomial_from_roots_quadratic(xs, begin, end, tree[node], modulus);
+        return;
+    }
+
+    size_t middle = begin + (end - begin) / 2;
+    build_subproduct_tree(xs, begin, middle, 2 * node + 1, tree, modulus);
+    build_subproduct_tree(xs, middle, end, 2 * node + 2, tree, modulus);
+    polynomial_multiply(tree[2 * node + 1], tree[2 * node + 2], tree[node], modulus);
+}
+
+/* evaluates p at xs[begin], ..., xs[end - 1], where p has already been reduced
+   modulo tree[node], by going down the remainder tree. */
+template <typename Modulus>
+void evaluate_on_subproduct_tree(const vector<uint64_t> &p,
+                                 const vector<uint64_t> &xs,
+                                 size_t begin,
+                                 size_t end,
+                                 size_t node,
+                                 vector<vector<uint64_t>> &tree,
+                                 vector<uint64_t> &values,
+                                 const Modulus &modulus)
+{
+    if (end - begin <= SUBPRODUCT_TREE_LEAF_SIZE) {
+        // Horner's method for each point
+        for (size_t i = begin; i < end; i++) {
+            uint64_t x = xs[i] % modulus;
+            uint64_t value = 0;
+            for (size_t j = p.size(); j > 0; j--) {
+                value = (modulus.mul(value, x) + p[j - 1]) % modulus;
+            }
+            values[i] = value;
+        }
+        return;
+    }
+
+    size_t middle = begin + (end - begin) / 2;
+    vector<uint64_t> remainder;
+    polynomial_remainder(p, tree[2 * node + 1], remainder, modulus);
+    evaluate_on_subproduct_tree(remainder, xs, begin, middle, 2 * node + 1, tree, values, modulus);
+    polynomial_remainder(p, tree[2 * node + 2], remainder, modulus);
+    evaluate_on_subproduct_tree(remainder, xs, middle, end, 2 * node + 2, tree, values, modulus);
+}
+
+/* computes \sum_i weights[i] * \prod_{j != i} (x - xs[j]) over the range of
+   the given node, by combining the sums of its children:
+   sum = sum_left * tree[right] + sum_right * tree[left] */
+template <typename Modulus>
+void combine_on_subproduct_tree(const vector<uint64_t> &xs,
+                                const vector<uint64_t> &weights,
+                                size_t begin,
+                                size_t end,
+                                size_t node,
+                                vector<vector<uint64_t>> &tree,
+                                vector<uint64_t> &sum,
+                                const Modulus &modulus)
+{
+    if (end - begin <= SUBPRODUCT_TREE_LEAF_SIZE) {
+        // divide the leaf's product by each (x - xs[i]) in turn.
+        const vector<uint64_t> &product = tree[node];
+        size_t size = end - begin;
+        sum.assign(size, 0);
+        for (size_t i = begin; i < end; i++) {
+            uint64_t x = xs[i] % modulus;
+            uint64_t q = product[size];
+            for (size_t j = size; j > 0; j--) {
+                // q = coefficient j - 1 of product / (x - xs[i])
+                sum[j - 1] = (sum[j - 1] + modulus.mul(weights[i], q)) % modulus;
+                q = (product[j - 1] + modulus.mul(x, q)) % modulus;
+            }
+        }
+        return;
+    }
+
+    size_t middle = begin + (end - begin) / 2;
+    vector<uint64_t> left_sum, right_sum, left_term, right_term;
+    combine_on_subproduct_tree(xs, weights, begin, middle, 2 * node + 1, tree, left_sum, modulus);
+    combine_on_subproduct_tree(xs, weights, middle, end, 2 * node + 2, tree, right_sum, modulus);
+    polynomial_multiply(left_sum, tree[2 * node + 2], left_term, modulus);
+    polynomial_multiply(right_sum, tree[2 * node + 1], right_term, modulus);
+
+    sum.resize(max(left_term.size(), right_term.size()));
+    for (size_t i = 0; i < sum.size(); i++) {
+        uint64_t left_value = (i < left_term.size()) ? left_term[i] : 0;
+        uint64_t right_value = (i < right_term.size()) ? right_term[i] : 0;
+        sum[i] = (left_value + right_value) % modulus;
+    }
+}
+
+/* subquadratic version of polynomial_from_points: with M(x) = \prod (x - xs[i]),
+   f(x) = \sum_i ys[i] / M'(xs[i]) * M(x) / (x - xs[i]), and both the values of
+   M' and the sum can be computed on a subproduct tree. */
+template <typename Modulus>
+void polynomial_from_points_fast(vector<uint64_t> &xs,
+                                 vector<uint64_t> &ys,
+                                 vector<uint64_t> &coeffs,
+                                 const Modulus &modulus)
+{
+    size_t n = xs.size();
+    // a tree over n points with leaves of at most SUBPRODUCT_TREE_LEAF_SIZE
+    // points has fewer than 4 * n / SUBPRODUCT_TREE_LEAF_SIZE + 1 nodes
+    vector<vector<uint64_t>> tree(4 * (n / SUBPRODUCT_TREE_LEAF_SIZE + 1));
+    build_subproduct_tree(xs, 0, n, 0, tree, modulus);
+
+    // M'(x), which has a lower degree than M, so it's already reduced
+    const vector<uint64_t> &product = tree[0];
+    vector<uint64_t> derivative(n);
+    for (size_t i = 1; i <= n; i++) {
+        derivative[i - 1] = modulus.mul(product[i], i % modulus);
+    }
+
+    vector<uint64_t> weights(n);
+    evaluate_on_subproduct_tree(derivative, xs, 0, n, 0, tree, weights, modulus);
+    batch_modinv(weights, modulus);
+    for (size_t i = 0; i < n; i++) {
+        weights[i] = modulus.mul(weights[i], ys[i] % modulus);
+    }
+
+    combine_on_subproduct_tree(xs, weights, 0, n, 0, tree, coeffs, modulus);
+    coeffs.resize(n, 0);
+}
+
+template <typename Modulus>
+void polynomial_from_points(vector<uint64_t> &xs,
+                            vector<uint64_t> &ys,
+                            vector<uint64_t> &coeffs,
+                            const Modulus &modulus)
+{
+    assert(xs.size() == ys.size());
+    coeffs.clear();
+    coeffs.resize(xs.size());
+
+    if (xs.size() == 0) {
+        return;
+    }
+
+    if (xs.size() > FAST_INTERPOLATION_THRESHOLD) {
+        polynomial_from_points_fast(xs, ys, coeffs, modulus);
+    } else {
+        polynomial_from_points_quadratic(xs, ys, coeffs, modulus);
+    }
+}
+
+// the lockstep functions process the polynomials in blocks of this many. all
+// the arithmetic on a block is done on GCC vector types, with one lane per
+// polynomial, so it compiles to SIMD instructions (e.g. two AVX-512 or four
+// AVX2 registers per operation).
+const size_t LOCKSTEP_LANES = 16;
+
+typedef double double_lanes __attribute__((vector_size(LOCKSTEP_LANES * sizeof(double))));
+typedef uint64_t integer_lanes __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint64_t))));
+
+/* modular arithmetic on lanes of doubles. this is exact as long as
+   modulus < 2^26, so that every product of two reduced values fits in the
+   52-bit mantissa. unlike MUL_MOD, it doesn't need an integer division, which
+   SIMD units don't have. the conditional corrections are done with bit
+   operations on the sign bit, because GCC scalarizes comparisons of vectors
+   wider than the target's registers. */
+template <typename Modulus>
+struct double_mod_arith {
+    typedef double_lanes lanes;
+
+    Modulus modulus;
+    lanes modulus_lanes;
+    lanes modulus_inverse;
+
+    double_mod_arith(const Modulus &modulus) : modulus(modulus) {
+        modulus_lanes = broadcast(modulus);
+        modulus_inverse = 1.0 / modulus_lanes;
+    }
+
+    static bool supports(uint64_t modulus) {
+        return modulus < (1ull << 26);
+    }
+
+    lanes broadcast(uint64_t x) const {
+        return (lanes) {} + (double) x;
+    }
+
+    // maps x in (-modulus, modulus) to x mod modulus, by adding modulus in
+    // the lanes where x is negative. exact zeros are never -0.0 here.
+    lanes make_nonnegative(const lanes &x) const {
+        integer_lanes negative = ((integer_lanes) x) >> 63;
+        return x + (lanes) (((integer_lanes) modulus_lanes) & -negative);
+    }
+
+    lanes add(const lanes &a, const lanes &b) const {
+        return make_nonnegative(a + b - modulus_lanes);
+    }
+
+    // replaces the lanes of reduced x that are 0 by 1. x - 1 is negative
+    // exactly in those lanes.
+    lanes nonzero(const lanes &x) const {
+        integer_lanes zero = ((integer_lanes) (x - 1.0)) >> 63;
+        return x + (lanes) (((integer_lanes) broadcast(1)) & -zero);
+    }
+
+    lanes sub(const lanes &a, const lanes &b) const {
+        return make_nonnegative(a - b);
+    }
+
+    lanes mul(const lanes &a, const lanes &b) const {
+        // adding and subtracting 1.5 * 2^52 rounds the estimated quotient to
+        // the nearest integer. it is off by at most one from the real
+        // quotient, so the remainder is in (-modulus, modulus).
+        const double round_constant = 6755399441055744.0;
+        lanes product = a * b;
+        lanes quotient = (product * modulus_inverse + round_constant) - round_constant;
+        return make_nonnegative(product - quotient * modulus_lanes);
+    }
+};
+
+/* the same interface on top of Modulus::mul, for moduli that are too big for
+   double_mod_arith. only additions are done on whole vectors. */
+template <typename Modulus>
+struct integer_mod_arith {
+    typedef integer_lanes lanes;
+
+    Modulus modulus;
+    lanes modulus_lanes;
+
+    integer_mod_arith(const Modulus &modulus) : modulus(modulus) {
+        modulus_lanes = broadcast(modulus);
+    }
+
+    lanes broadcast(uint64_t x) const {
+        return (lanes) {} + x;
+    }
+
+    lanes add(const lanes &a, const lanes &b) const {
+        lanes sum = a + b;
+        return (sum >= modulus_lanes) ? (sum - modulus_lanes) : sum;
+    }
+
+    lanes sub(const lanes &a, const lanes &b) const {
+        return (a >= b) ? (a - b) : (a + modulus_lanes - b);
+    }
+
+    lanes nonzero(const lanes &x) const {
+        return (x == 0) ? (x + 1) : x;
+    }
+
+    lanes mul(const lanes &a, const lanes &b) const {
+        lanes product;
+        for (size_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            product[lane] = modulus.mul(a[lane], b[lane]);
+        }
+        return product;
+    }
+};
+
+/* runs the recurrence of polynomial_from_roots_quadratic on the polynomials
+   begin, ..., begin + LOCKSTEP_LANES - 1 (or fewer, for the last block). */
+template <typename Arith>
+void polynomials_from_roots_block(const Arith &arith,
+                                  const vector<uint64_t> &roots,
+                                  size_t count,
+                                  size_t begin,
+                                  vector<typename Arith::lanes> &block,
+                                  vector<uint64_t> &coeffs)
+{
+    typedef typename Arith::lanes lanes;
+    size_t size = roots.size() / count;
+    size_t used_lanes = min(LOCKSTEP_LANES, count - begin);
+    auto &modulus = arith.modulus;
+
+    // block[j] holds the jth coefficients of all polynomials of the block.
+    // unused lanes compute the polynomial x^size.
+    block.assign(size + 1, arith.broadcast(0));
+    block[0] = arith.broadcast(1);
+
+    lanes neg_roots = arith.broadcast(0);
+    for (size_t i = 0; i < size; i++) {
+        for (size_t lane = 0; lane < used_lanes; lane++) {
+            neg_roots[lane] = (modulus - (roots[i * count + begin + lane] % modulus)) % modulus;
+        }
+
+        // multiply every polynomial by (x - root)
+        for (size_t j = i + 1; j > 0; j--) {
+            block[j] = arith.add(block[j - 1], arith.mul(neg_roots, block[j]));
+        }
+        block[0] = arith.mul(block[0], neg_roots);
+    }
+
+    for (size_t j = 0; j < size + 1; j++) {
+        for (size_t lane = 0; lane < used_lanes; lane++) {
+            coeffs[j * count + begin + lane] = (uint64_t) block[j][lane];
+        }
+    }
+}
+
+template <typename Arith>
+void polynomials_from_roots_lockstep_with(const Arith &arith,
+                                          const vector<uint64_t> &roots,
+                                          size_t count,
+                                          vector<uint64_t> &coeffs)
+{
+    vector<typename Arith::lanes> block;
+    for (size_t begin = 0; begin < count; begin += LOCKSTEP_LANES) {
+        polynomials_from_roots_block(arith, roots, count, begin, block, coeffs);
+    }
+}
+
+template <typename Modulus>
+void polynomials_from_roots_lockstep(const vector<uint64_t> &roots,
+                                     size_t count,
+                                     vector<uint64_t> &coeffs,
+                                     const Modulus &modulus)
+{
+    assert((count > 0) && (roots.size() % count == 0));
+    size_t size = roots.size() / count;
+    coeffs.resize((size + 1) * count);
+
+    if (size > PRODUCT_TREE_THRESHOLD) {
+        // the polynomials are big enough for the subquadratic algorithm to
+        // win, so build them one by one.
+        vector<uint64_t> current_roots(size), current_coeffs;
+        for (size_t b = 0; b < count; b++) {
+            for (size_t k = 0; k < size; k++) {
+                current_roots[k] = roots[k * count + b];
+            }
+            polynomial_from_roots(current_roots, current_coeffs, modulus);
+            for (size_t j = 0; j < size + 1; j++) {
+                coeffs[j * count + b] = current_coeffs[j];
+            }
+        }
+        return;
+    }
+
+    if (double_mod_arith<Modulus>::supports(modulus)) {
+        polynomials_from_roots_lockstep_with(double_mod_arith<Modulus>(modulus), roots, count, coeffs);
+    } else {
+        polynomials_from_roots_lockstep_with(integer_mod_arith<Modulus>(modulus), roots, count, coeffs);
+    }
+}
+
+/* runs the recurrence of polynomial_from_points_quadratic on the polynomials
+   begin, ..., begin + LOCKSTEP_LANES - 1 (or fewer, for the last block).
+   lanes with fewer points than others keep going past their last point, but
+   the Newton terms they compute there are multiplied by 0. */
+template <typename Arith>
+void polynomials_from_points_block(const Arith &arith,
+                                   const vector<uint64_t> &xs,
+                                   const vector<uint64_t> &ys,
+                                   const vector<size_t> &sizes,
+                                   size_t begin,
+                                   vector<uint64_t> &coeffs)
+{
+    typedef typename Arith::lanes lanes;
+    size_t count = sizes.size();
+    size_t max_size = xs.size() / count;
+    size_t used_lanes = min(LOCKSTEP_LANES, count - begin);
+    auto &modulus = arith.modulus;
+    lanes zero = arith.broadcast(0);
+    lanes one = arith.broadcast(1);
+
+    // all of these are laid out like block in polynomials_from_roots_block.
+    // unused lanes and missing points are zero.
+    vector<lanes> block_xs(max_size, zero), ddif(max_size, zero);
+    vector<lanes> basis(max_size, zero), block(max_size, zero), dens(max_size);
+    size_t lane_sizes[LOCKSTEP_LANES] = {};
+    for (size_t lane = 0; lane < used_lanes; lane++) {
+        lane_sizes[lane] = sizes[begin + lane];
+        assert(lane_sizes[lane] <= max_size);
+        for (size_t k = 0; k < lane_sizes[lane]; k++) {
+            block_xs[k][lane] = xs[k * count + begin + lane] % modulus;
+            ddif[k][lane] = ys[k * count + begin + lane] % modulus;
+        }
+    }
+    basis[0] = one;
+
+    lanes active;
+    for (size_t i = 0; i < max_size; i++) {
+        // add the next Newton term, in the lanes that still have one. active
+        // is 0 or 1 in each lane, so a plain multiplication is enough.
+        for (size_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            active[lane] = (i < lane_sizes[lane]) ? 1 : 0;
+        }
+        lanes factor = ddif[0] * active;
+        for (size_t j = 0; j < i + 1; j++) {
+            block[j] = arith.add(block[j], arith.mul(factor, basis[j]));
+        }
+
+        if (i == max_size - 1) {
+            break;
+        }
+
+        // update basis: multiply it by (x - xs[i])
+        lanes x = block_xs[i];
+        for (size_t j = i + 1; j > 0; j--) {
+            basis[j] = arith.sub(basis[j - 1], arith.mul(x, basis[j]));
+        }
+        basis[0] = arith.sub(zero, arith.mul(basis[0], x));
+
+        // compute the denominators x_{j+i+1} - x_j, and their running products
+        // for the batched inversion. the points of a lane are distinct, so a
+        // zero denominator has to involve a missing point, and we can replace
+        // it by 1: the divided differences with missing points are never used.
+        size_t level_size = max_size - i - 1;
+        for (size_t j = 0; j < level_size; j++) {
+            lanes den = arith.nonzero(arith.sub(block_xs[j + i + 1], block_xs[j]));
+            dens[j] = (j > 0) ? arith.mul(dens[j - 1], den) : den;
+        }
+
+        lanes inverses;
+        for (size_t lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            inverses[lane] = modulus.inverse((uint64_t) dens[level_size - 1][lane]);
+        }
+
+        // going backwards, inverses = (den[0] * ... * den[j])^-1, so
+        // den[j]^-1 = inverses * dens[j - 1], which replaces dens[j].
+        for (size_t j = level_size - 1; j > 0; j--) {
+            lanes den = arith.nonzero(arith.sub(block_xs[j + i + 1], block_xs[j]));
+            dens[j] = arith.mul(inverses, dens[j - 1]);
+            inverses = arith.mul(inverses, den);
+        }
+        dens[0] = inverses;
+
+        // update ddif: compute length-(i + 1) divided differences.
+        // dd_{j,j+i+1} = (dd_{j+1, j+i+1} - dd_{j, j+i}) / (x_{j+i+1} - x_j)
+        for (size_t j = 0; j < level_size; j++) {
+            ddif[j] = arith.mul(arith.sub(ddif[j + 1], ddif[j]), dens[j]);
+        }
+    }
+
+    for (size_t j = 0; j < max_size; j++) {
+        for (size_t lane = 0; lane < used_lanes; lane++) {
+            coeffs[j * count + begin + lane] = (uint64_t) block[j][lane];
+        }
+    }
+}
+
+template <typename Arith>
+void polynomials_from_points_lockstep_with(const Arith &arith,
+                                           const vector<uint64_t> &xs,
+                                           const vector<uint64_t> &ys,
+                                           const vector<size_t> &sizes,
+                                           vector<uint64_t> &coeffs)
+{
+    for (size_t begin = 0; begin < sizes.size(); begin += LOCKSTEP_LANES) {
+        polynomials_from_points_block(arith, xs, ys, sizes, begin, coeffs);
+    }
+}
+
+template <typename Modulus>
+void polynomials_from_points_lockstep(const vector<uint64_t> &xs,
+                                      const vector<uint64_t> &ys,
+                                      const vector<size_t> &sizes,
+                                      vector<uint64_t> &coeffs,
+                                      const Modulus &modulus)
+{
+    size_t count = sizes.size();
+    assert((count > 0) && (xs.size() == ys.size()) && (xs.size() % count == 0));
+    size_t max_size = xs.size() / count;
+    coeffs.assign(max_size * count, 0);
+
+    if (max_size == 0) {
+        return;
+    }
+
+    if (max_size > FAST_INTERPOLATION_THRESHOLD) {
+        // the polynomials are big enough for the subquadratic algorithm to
+        // win, so interpolate them one by one.
+        vector<uint64_t> current_xs, current_ys, current_coeffs;
+        for (size_t b = 0; b < count; b++) {
+            current_xs.resize(sizes[b]);
+            current_ys.resize(sizes[b]);
+            for (size_t k = 0; k < sizes[b]; k++) {
+                current_xs[k] = xs[k * count + b];
+                current_ys[k] = ys[k * count + b];
+            }
+            polynomial_from_points(current_xs, current_ys, current_coeffs, modulus);
+            for (size_t j = 0; j < sizes[b]; j++) {
+                coeffs[j * count + b] = current_coeffs[j];
             }
         }
+        return;
     }
+
+    if (double_mod_arith<Modulus>::supports(modulus)) {
+        polynomials_from_points_lockstep_with(double_mod_arith<Modulus>(modulus), xs, ys, sizes, coeffs);
+    } else {
+        polynomials_from_points_lockstep_with(integer_mod_arith<Modulus>(modulus), xs, ys, sizes, coeffs);
+    }
+}
+
+// the public functions dispatch to the right Modulus once per call.
+
+void polynomial_multiply(const vector<uint64_t> &a,
+                         const vector<uint64_t> &b,
+                         vector<uint64_t> &result,
+                         uint64_t modulus)
+{
+    with_modulus(modulus, [&](auto fixed) {
+        polynomial_multiply(a, b, result, fixed);
+    });
+}
+
+void polynomial_from_roots(vector<uint64_t> &roots, vector<uint64_t> &coeffs, uint64_t modulus) {
+    with_modulus(modulus, [&](auto fixed) {
+        polynomial_from_roots(roots, coeffs, fixed);
+    });
+}
+
+void polynomial_replace_root(vector<uint64_t> &coeffs,
+                             uint64_t old_root,
+                             uint64_t new_root,
+                             uint64_t modulus)
+{
+    with_modulus(modulus, [&](auto fixed) {
+        polynomial_replace_root(coeffs, old_root, new_root, fixed);
+    });
+}
+
+void polynomial_remove_point(vector<uint64_t> &coeffs,
+                             const vector<uint64_t> &others,
+                             uint64_t modulus)
+{
+    with_modulus(modulus, [&](auto fixed) {
+        polynomial_remove_point(coeffs, others, fixed);
+    });
+}
+
+void polynomial_add_point(vector<uint64_t> &coeffs,
+                          const vector<uint64_t> &others,
+                          uint64_t x,
+                          uint64_t y,
+                          uint64_t modulus)
+{
+    with_modulus(modulus, [&](auto fixed) {
+        polynomial_add_point(coeffs, others, x, y, fixed);
+    });
+}
+
+void polynomial_from_points(vector<uint64_t> &xs,
+                            vector<uint64_t> &ys,
+                            vector<uint64_t> &coeffs,
+                            uint64_t modulus)
+{
+    with_modulus(modulus, [&](auto fixed) {
+        polynomial_from_points(xs, ys, coeffs, fixed);
+    });
+}
+
+void polynomials_from_roots_lockstep(const vector<uint64_t> &roots,
+                                     size_t count,
+                                     vector<uint64_t> &coeffs,
+                                     uint64_t modulus)
+{
+    with_modulus(modulus, [&](auto fixed) {
+        polynomials_from_roots_lockstep(roots, count, coeffs, fixed);
+    });
+}
+
+void polynomials_from_points_lockstep(const vector<uint64_t> &xs,
+                                      const vector<uint64_t> &ys,
+                                      const vector<size_t> &sizes,
+                                      vector<uint64_t> &coeffs,
+                                      uint64_t modulus)
+{
+    with_modulus(modulus, [&](auto fixed) {
+        polynomials_from_points_lockstep(xs, ys, sizes, coeffs, fixed);
+    });
 }
@@ -21,20 +21,192 @@ as vectors of coefficients.
     #define MUL_MOD(a, b, m) ((((__uint128_t) (a)) * ((__uint128_t) (b))) % (m))
 #endif
 
+/*
+The plain modulus is always one of the few primes listed in
+PSIParams::plain_modulus(), so modular arithmetic can be specialized for each of
+them at compile time. Code that does a lot of modular arithmetic is templated
+over a `Modulus`, which is either:
+- fixed_modulus<p>, where p is a compile-time constant. the compiler turns
+  every `% p` into multiplications and shifts, and products that don't fit in
+  64 bits are reduced with Barrett reduction instead of a 128-bit division.
+  with MODULUS_IS_SMALL, only the primes of up to 32 bits get one.
+- runtime_modulus, for any other modulus, which uses MUL_MOD.
+Both convert implicitly to uint64_t, so `x % modulus` works with either, and
+both have mul(a, b), pow(a, b) and inverse(a) for reduced a and b.
+with_modulus(m, f) calls f with the right one, so that we dispatch once per
+call instead of once per operation.
+*/
+
+/* modinv_table_65537()[x] is the inverse of x mod 65537, for 0 < x < 65537. */
+const uint32_t *modinv_table_65537();
+
+constexpr size_t modulus_bits(uint64_t modulus) {
+    return (modulus == 0) ? 0 : (1 + modulus_bits(modulus >> 1));
+}
+
+template <typename Modulus>
+uint64_t modulus_pow(const Modulus &modulus, uint64_t base, uint64_t exponent) {
+    uint64_t result = 1;
+    while (exponent > 0) {
+        if (exponent & 1) {
+            result = modulus.mul(result, base);
+        }
+        base = modulus.mul(base, base);
+        exponent = (exponent >> 1);
+    }
+    return result;
+}
+
+template <uint64_t p>
+struct fixed_modulus {
+    static constexpr size_t bits = modulus_bits(p);
+#ifdef MODULUS_IS_SMALL
+    static_assert(bits <= 32, "MODULUS_IS_SMALL only supports moduli of up to 32 bits");
+#else
+    // floor(2^(2 * bits) / p), for Barrett reduction
+    static constexpr __uint128_t barrett_ratio = (((__uint128_t) 1) << (2 * bits)) / p;
+#endif
+
+    constexpr operator uint64_t() const {
+        return p;
+    }
+
+    uint64_t mul(uint64_t a, uint64_t b) const {
+#ifdef MODULUS_IS_SMALL
+        return (a * b) % p;
+#else
+        if constexpr (bits <= 32) {
+            return (a * b) % p;
+        } else {
+            // the estimated quotient is at most 2 less than the real one
+            __uint128_t product = ((__uint128_t) a) * b;
+            __uint128_t quotient = ((product >> (bits - 1)) * barrett_ratio) >> (bits + 1);
+            uint64_t remainder = (uint64_t) (product - quotient * p);
+            remainder = (remainder >= p) ? (remainder - p) : remainder;
+            return (remainder >= p) ? (remainder - p) : remainder;
+        }
+#endif
+    }
+
+    uint64_t pow(uint64_t base, uint64_t exponent) const {
+        return modulus_pow(*this, base, exponent);
+    }
+
+    uint64_t inverse(uint64_t x) const {
+        if constexpr (p == 65537) {
+            return modinv_table_65537()[x];
+        } else {
+            return pow(x, p - 2);
+        }
+    }
+};
+
+struct runtime_modulus {
+    uint64_t value;
+
+    runtime_modulus(uint64_t value) : value(value) {}
+
+    operator uint64_t() const {
+        return value;
+    }
+
+    uint64_t mul(uint64_t a, uint64_t b) const {
+        return MUL_MOD(a, b, value);
+    }
+
+    uint64_t pow(uint64_t base, uint64_t exponent) const {
+        return modulus_pow(*this, base, exponent);
+    }
+
+    uint64_t inverse(uint64_t x) const {
+        return pow(x, value - 2);
+    }
+};
+
+template <typename F>
+auto with_modulus(uint64_t modulus, F f) {
+    switch (modulus) {
+        case 65537ull: return f(fixed_modulus<65537ull>());
+        case 1146881ull: return f(fixed_modulus<1146881ull>());
+        case 2424833ull: return f(fixed_modulus<2424833ull>());
+        case 8519681ull: return f(fixed_modulus<8519681ull>());
+#ifndef MODULUS_IS_SMALL
+        case 34359771137ull: return f(fixed_modulus<34359771137ull>());
+        case 68720066561ull: return f(fixed_modulus<68720066561ull>());
+        case 137439477761ull: return f(fixed_modulus<137439477761ull>());
+#endif
+        default: return f(runtime_modulus(modulus));
+    }
+}
+
 /* modexp(a, b, m) computes a^b mod m in O(log b) time. */
 uint64_t modexp(uint64_t base, uint64_t exponent, uint64_t modulus);
 
-/* modinv(a, m) computes a^-1 mod m in O(log m) time. */
+/* modinv(a, m) computes a^-1 mod m in O(log m) time, or O(1) for m = 65537. */
 uint64_t modinv(uint64_t x, uint64_t modulus);
 
+/*
+polynomial_multiply(a, b) computes the coefficients of the product of the
+polynomials a and b. result may be the same vector as a or b.
+
+if the plain modulus has a primitive root of unity of the right power-of-two
+order (which is the case for all the moduli used for batching), this uses an
+NTT.
+
+time complexity: O(n log n) with an NTT, O(n²) otherwise, where n is the size
+of the result
+*/
+void polynomial_multiply(const vector<uint64_t> &a,
+                         const vector<uint64_t> &b,
+                         vector<uint64_t> &result,
+                         uint64_t modulus);
+
 /*
 polynomial_from_roots(l) computes the coefficients of the polynomial
 (x - l[0]) * (x - l[1]) * ...
 
-time complexity: O(n²), where n is the size of l
+time complexity: O(n log² n), where n is the size of l, if polynomial_multiply
+can use an NTT
 */
 void polynomial_from_roots(vector<uint64_t> &roots, vector<uint64_t> &coeffs, uint64_t modulus);
 
+/*
+polynomial_replace_root(coeffs, old_root, new_root) takes the coefficients of a
+polynomial f with f(old_root) = 0 and replaces them with the coefficients of
+f(x) * (x - new_root) / (x - old_root).
+
+time complexity: O(n), where n is the size of coeffs
+*/
+void polynomial_replace_root(vector<uint64_t> &coeffs,
+                             uint64_t old_root,
+                             uint64_t new_root,
+                             uint64_t modulus);
+
+/*
+polynomial_remove_point(coeffs, others) takes the coefficients of the polynomial
+f that interpolates a set of points, and replaces them with the coefficients of
+the one that interpolates all of them but one. `others` are the coefficients of
+the product of (x - x_i) over the points that remain, i.e. without the removed
+one.
+
+polynomial_add_point(coeffs, others, x, y) does the opposite: it replaces f,
+which interpolates the points whose product of (x - x_i) is `others`, with the
+polynomial that also has f(x) = y. x must not be one of the points.
+
+in both cases, coeffs must have at least others.size() entries, and the ones
+past those are left alone.
+
+time complexity: O(n), where n is the size of others
+*/
+void polynomial_remove_point(vector<uint64_t> &coeffs,
+                             const vector<uint64_t> &others,
+                             uint64_t modulus);
+void polynomial_add_point(vector<uint64_t> &coeffs,
+                          const vector<uint64_t> &others,
+                          uint64_t x,
+                          uint64_t y,
+                          uint64_t modulus);
+
 /*
 polynomial_from_points(xs, ys) computes the coefficients of a
 (xs.size() - 1)-degree polynomial f with f(xs[i]) = ys[i] for each i.
@@ -42,9 +214,42 @@ polynomial_from_points(xs, ys) computes the coefficients of a
 if two points with the same x exist, the behavior is undefined, even if their y
 are the same.
 
-time complexity: O(n²), where n is the size of xs
+large inputs are interpolated on a subproduct tree, small ones with Newton's
+divided differences.
+
+time complexity: O(n log² n), where n is the size of xs, if polynomial_multiply
+can use an NTT
 */
 void polynomial_from_points(vector<uint64_t> &xs,
                             vector<uint64_t> &ys,
                             vector<uint64_t> &coeffs,
                             uint64_t modulus);
+
+/*
+polynomials_from_roots_lockstep(roots, count) computes polynomial_from_roots for
+`count` sets of roots of the same size at once. the kth root of set b is
+roots[k * count + b], and the jth coefficient of polynomial b is written to
+coeffs[j * count + b], so that each coefficient of all polynomials is
+contiguous, the way BatchEncoder wants it.
+
+small polynomials are built in blocks that are processed with SIMD
+instructions, big ones one by one with polynomial_from_roots.
+*/
+void polynomials_from_roots_lockstep(const vector<uint64_t> &roots,
+                                     size_t count,
+                                     vector<uint64_t> &coeffs,
+                                     uint64_t modulus);
+
+/*
+polynomials_from_points_lockstep(xs, ys, sizes) computes polynomial_from_points
+for sizes.size() sets of points at once. set b has sizes[b] points, which are
+(xs[k * count + b], ys[k * count + b]) for k < sizes[b]; the other entries are
+ignored. with max_size = xs.size() / count, coeffs gets max_size coefficients
+per polynomial, laid out like in polynomials_from_roots_lockstep; polynomial b's
+coefficients past sizes[b] are 0.
+*/
+void polynomials_from_points_lockstep(const vector<uint64_t> &xs,
+                                      const vector<uint64_t> &ys,
+                                      const vector<size_t> &sizes,
+                                      vector<uint64_t> &coeffs,
+                                      uint64_t modulus);
@@ -0,0 +1,60 @@
+#include <cstdlib>
+#include <iostream>
+
+#include "windowing.h"
+
+using namespace std;
+
+/*
+For a given highest power (PSIParams::max_query_power()), prints the powers
+that the receiver would send for every query depth budget (see
+PSIParams::set_query_depth), with how many ciphertexts that makes the query and
+how many products the sender then needs to compute the rest, next to the same
+numbers for the usual windows.
+*/
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        cout << "USAGE:" << endl;
+        cout << argv[0] << " max_power" << endl;
+        return 1;
+    }
+
+    size_t max_power = atol(argv[1]);
+    if (max_power == 0) {
+        cout << "max_power must be positive" << endl;
+        return 1;
+    }
+
+    // the depth needed to compute everything from y alone
+    size_t max_depth = 0;
+    while ((1ull << max_depth) < max_power) {
+        max_depth++;
+    }
+
+    cout << "depth\tsent\tproducts\tpowers" << endl;
+    for (size_t depth = 1; depth <= max_depth; depth++) {
+        auto powers = Windowing::sparse_powers(max_power, depth);
+        cout << depth << "\t" << powers.size() << "\t" << (max_power - powers.size()) << "\t";
+        for (auto power : powers) {
+            cout << " " << power;
+        }
+        cout << endl;
+    }
+
+    cout << endl << "window_size\tdepth\tsent\tproducts" << endl;
+    for (size_t window_size = 1; (1ull << window_size) <= 2 * max_power; window_size++) {
+        Windowing windowing(window_size, max_power);
+        size_t used = 0;
+        for (auto power : windowing.source_powers()) {
+            if (power <= max_power) {
+                used++;
+            }
+        }
+        cout << window_size << "\t" << windowing.depth(max_power)
+             << "\t" << windowing.source_powers().size()
+             << "\t" << (max_power - used) << endl;
+    }
+
+    return 0;
+}
@@ -1,11 +1,27 @@
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
 #include <utility>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "seal/seal.h"
+#include "seal/util/ntt.h"
 
+#include "aes.h"
+#include "dot_product.h"
 #include "hashing.h"
 #include "polynomials.h"
 #include "random.h"
+#include "seeded.h"
+#include "threads.h"
 #include "windowing.h"
 
 #include "psi.h"
@@ -18,23 +34,211 @@
 SecretKey *receiver_key_leaked;
 #endif
 
+/* takes a mask from `mask_pool` (if it isn't null or empty), or makes one
+   with `random` and `encoder`. */
 void multiply_by_random_mask(Ciphertext &ciphertext,
-                             shared_ptr<UniformRandomGenerator> random,
+                             MaskPool *mask_pool,
+                             AESRandom &random,
                              BatchEncoder &encoder,
                              Evaluator &evaluator,
-                             RelinKeys &relin_keys,
                              uint64_t plain_modulus)
 {
-    size_t slot_count = encoder.slot_count();
-    Plaintext mask(slot_count, slot_count);
-    for (size_t j = 0; j < slot_count; j++) {
-        mask[j] = random_nonzero_integer(random, plain_modulus);
+    // a plaintext product doesn't grow the ciphertext, so there is nothing
+    // to relinearize.
+    Plaintext mask;
+    if ((mask_pool != nullptr) && mask_pool->pop(mask)) {
+        // pooled masks are in NTT form. multiply_plain would transform the
+        // ciphertext back and forth anyway, so this only saves the mask's NTT.
+        evaluator.transform_to_ntt_inplace(ciphertext);
+        evaluator.multiply_plain_inplace(ciphertext, mask);
+        evaluator.transform_from_ntt_inplace(ciphertext);
+    } else {
+        random_mask(random, encoder, plain_modulus, mask);
+        evaluator.multiply_plain_inplace(ciphertext, mask);
+    }
+}
+
+const uint64_t SENDER_DB_MAGIC = 0x5043534e44524442ull; // 'PCSNDRDB'
+// bump this whenever the layout of the file changes.
+const uint64_t SENDER_DB_VERSION = 4;
+const size_t SENDER_DB_MAX_SEEDS = 8;
+// the header is padded to this size, so that the data is page aligned.
+const size_t SENDER_DB_HEADER_SIZE = 4096;
+
+/* the on-disk layout of a PSISenderDB is this header, padded to
+   SENDER_DB_HEADER_SIZE bytes, followed by `data_size` uint64_t words that
+   are exactly the contents of PSISenderDB::data. like SEAL's serialization,
+   this is not endianness-aware. */
+struct sender_db_header
+{
+    uint64_t magic;
+    uint64_t version;
+    uint64_t sender_size;
+    uint64_t input_bits;
+    uint64_t poly_modulus_degree;
+    uint64_t partition_count;
+    uint64_t window_size;
+    uint64_t ps_low_degree;
+    uint64_t query_depth;
+    uint64_t labeled;
+    uint64_t ntt_form;
+    uint64_t seeds[SENDER_DB_MAX_SEEDS];
+    uint64_t plaintext_size;
+    uint64_t data_size;
+};
+
+/* the number of uint64_t words each plaintext takes up in a PSISenderDB. */
+size_t sender_db_plaintext_size(PSIParams &params)
+{
+    size_t size = params.poly_modulus_degree();
+    if (params.ntt_evaluation()) {
+        // an NTT form plaintext has one copy of its coefficients for every
+        // prime in the coefficient modulus.
+        auto context_data = params.context->context_data(params.context->first_parms_id());
+        size *= context_data->parms().coeff_modulus().size();
+    }
+    return size;
+}
+
+/* the number of uint64_t words of plaintexts in a PSISenderDB. every
+   partition has one more coefficient than it has rows. */
+size_t sender_db_data_size(PSIParams &params, bool labeled)
+{
+    return (params.sender_bucket_capacity() + params.sender_partition_count())
+           * (labeled ? 2 : 1) * sender_db_plaintext_size(params);
+}
+
+void check_sender_db_header(sender_db_header &header)
+{
+    if (header.magic != SENDER_DB_MAGIC) {
+        throw runtime_error("not a sender DB");
+    }
+    if (header.version != SENDER_DB_VERSION) {
+        throw runtime_error("the sender DB was written by a different version");
+    }
+}
+
+/* checks that `params` are the ones the DB with this header was built with,
+   i.e. that they came from read_params on the same file. */
+void check_sender_db_params(sender_db_header &header, PSIParams &params)
+{
+    bool matches = (header.sender_size == params.sender_size)
+                   && (header.input_bits == params.input_bits)
+                   && (header.poly_modulus_degree == params.poly_modulus_degree())
+                   && (header.partition_count == params.sender_partition_count())
+                   && (header.window_size == params.window_size())
+                   && (header.ps_low_degree == params.ps_low_degree())
+                   && (header.query_depth == params.query_depth())
+                   && ((header.ntt_form != 0) == params.ntt_evaluation())
+                   && (header.plaintext_size == sender_db_plaintext_size(params))
+                   && (params.seeds.size() == params.hash_functions());
+    for (size_t i = 0; matches && (i < params.hash_functions()); i++) {
+        matches = (header.seeds[i] == params.seeds[i]);
+    }
+    if (!matches) {
+        throw runtime_error("the params don't match the ones the sender DB was built with");
+    }
+}
+
+/* sum = \sum_k powers[k] * coeffs[k], where the powers are in NTT form and
+   coeffs[k] points to the words of an NTT form plaintext (see
+   PSISenderDB::coeffs_data). this is what multiply_plain and add_inplace
+   would compute term by term, but each coefficient of the sum is only
+   reduced once (see dot_product_mod), instead of once per product and once
+   per sum. */
+void ntt_dot_product(shared_ptr<SEALContext> context,
+                     const Ciphertext *powers,
+                     const vector<const uint64_t*> &coeffs,
+                     Ciphertext &sum)
+{
+    size_t count = coeffs.size();
+    assert(count > 0);
+    auto context_data = context->context_data(powers[0].parms_id());
+    size_t n = context_data->parms().poly_modulus_degree();
+    auto &coeff_modulus = context_data->parms().coeff_modulus();
+    size_t size = powers[0].size();
+
+    sum.resize(context, powers[0].parms_id(), size);
+    sum.is_ntt_form() = true;
+
+    vector<const uint64_t*> power_data(count), coeff_data(count);
+    for (size_t poly = 0; poly < size; poly++) {
+        for (size_t i = 0; i < coeff_modulus.size(); i++) {
+            for (size_t k = 0; k < count; k++) {
+                assert(powers[k].size() == size);
+                power_data[k] = powers[k].data(poly) + i * n;
+                coeff_data[k] = coeffs[k] + i * n;
+            }
+            dot_product_mod(power_data.data(), coeff_data.data(), count, n,
+                            coeff_modulus[i].value(), sum.data(poly) + i * n);
+        }
     }
-    encoder.encode(mask);
-    evaluator.multiply_plain_inplace(ciphertext, mask);
-    evaluator.relinearize_inplace(ciphertext, relin_keys);
 }
 
+// how many bits of noise budget switching a response to a smaller coefficient
+// modulus may cost at most (see response_parms_id)
+const size_t RESPONSE_NOISE_MARGIN_BITS = 5;
+
+/* the parms_id with the fewest primes that the sender's responses can be
+   switched to before they're sent, which shrinks them by the number of primes
+   dropped. mod switching scales the noise that a response already has down
+   with the modulus, but adds the rounding error e, and with it t * e(s) / q'
+   to the invariant noise. for a ternary secret key, the coefficients of e(s)
+   are below about 6 * sqrt(n / 18) + 1 with overwhelming probability, so the
+   smallest q' that keeps that under 2^-RESPONSE_NOISE_MARGIN_BITS of the
+   noise budget is picked. */
+parms_id_type response_parms_id(PSIParams &params)
+{
+    double rounding_error = 6 * sqrt(params.poly_modulus_degree() / 18.0) + 1;
+    double needed_bits = modulus_bits(params.plain_modulus()) + log2(rounding_error) + 1
+                         + RESPONSE_NOISE_MARGIN_BITS;
+
+    auto context_data = params.context->first_context_data();
+    while (true) {
+        auto next = context_data->next_context_data();
+        if (!next || (next->total_coeff_modulus_bit_count() < needed_bits)) {
+            return context_data->parms_id();
+        }
+        context_data = next;
+    }
+}
+
+/* the powers of its input that the receiver sends, as agreed on in `params`. */
+Windowing query_windowing(PSIParams &params)
+{
+    if (params.relin_free()) {
+        // every power is sent, so the sender has nothing to compute
+        vector<size_t> powers(params.max_query_power());
+        iota(powers.begin(), powers.end(), 1);
+        return Windowing(powers);
+    }
+    if (params.query_depth() > 0) {
+        return Windowing(params.sparse_query_powers());
+    }
+    return Windowing(params.window_size(), params.max_query_power());
+}
+
+/* given x^b, computes giant_powers[i] = x^{i * b} for 0 < i < giant_powers.size()
+   using square-and-multiply, so that x^{i * b} has multiplicative depth of
+   about log2(i) on top of that of x^b. giant_powers[0] is left untouched. */
+void compute_giant_powers(Ciphertext &base,
+                          vector<Ciphertext> &giant_powers,
+                          Evaluator &evaluator,
+                          RelinKeys &relin_keys)
+{
+    if (giant_powers.size() < 2) {
+        return;
+    }
+    giant_powers[1] = base;
+    for (size_t i = 2; i < giant_powers.size(); i++) {
+        if (i % 2 == 0) {
+            evaluator.square(giant_powers[i / 2], giant_powers[i]);
+        } else {
+            evaluator.multiply(giant_powers[i - 1], giant_powers[1], giant_powers[i]);
+        }
+        evaluator.relinearize_inplace(giant_powers[i], relin_keys);
+    }
+}
 
 PSIParams::PSIParams(size_t receiver_size, size_t sender_size, size_t input_bits, size_t poly_modulus_degree)
     : receiver_size(receiver_size),
@@ -42,7 +246,19 @@ PSIParams::PSIParams(size_t receiver_size, size_t sender_size, size_t input_bits
       input_bits(input_bits),
       poly_modulus_degree_(poly_modulus_degree),
       sender_partition_count_(16),
-      window_size_(3)
+      window_size_(3),
+      thread_count_(1),
+      ntt_evaluation_(false),
+      ps_low_degree_(0),
+      query_depth_(0),
+      relin_free_(false),
+      receiver_stash_size_(0),
+      receiver_seed_retry_(false),
+      mask_pool_size_(0),
+      seeded_queries_(false),
+      seeded_keys_(false),
+      sparse_query_powers_max_(0),
+      sparse_query_powers_depth_(0)
 {
     assert((poly_modulus_degree_ == 8192) || (poly_modulus_degree_ == 16384));
 
@@ -73,6 +289,10 @@ void PSIParams::set_seeds(vector<uint64_t> &seeds_ext) {
     seeds = seeds_ext;
 }
 
+size_t PSIParams::poly_modulus_degree() {
+    return poly_modulus_degree_;
+}
+
 uint64_t PSIParams::plain_modulus() {
     // for batching to work, the plain modulus must be a prime that's equal
     // to 1 mod (2 * poly_modulus_degree).
@@ -158,10 +378,112 @@ size_t PSIParams::sender_partition_count() {
     return sender_partition_count_;
 }
 
+size_t PSIParams::max_partition_size() {
+    size_t partition_count = sender_partition_count();
+    return (sender_bucket_capacity() + (partition_count - 1)) / partition_count;
+}
+
+void PSIParams::sender_partition_rows(size_t partition, size_t &start, size_t &size) {
+    // we split the hash table into partitions: instead of looking at a hash
+    // table with `capacity` rows, split it into `partition_count` tables with
+    // roughly the same number of rows each.
+    // specifically, `big_partition_count` subtables will have
+    // `max_partition_size` rows, and the rest will have one fewer.
+    size_t capacity = sender_bucket_capacity();
+    size_t partition_count = sender_partition_count();
+    assert(capacity >= partition_count);
+    assert(partition < partition_count);
+    size_t max_size = max_partition_size();
+    size_t big_partition_count = capacity - (max_size - 1) * partition_count;
+
+    if (partition < big_partition_count) {
+        size = max_size;
+        start = max_size * partition;
+    } else {
+        size = max_size - 1;
+        start = max_size * partition - (partition - big_partition_count);
+    }
+}
+
+size_t PSIParams::sender_row_partition(size_t row) {
+    // the inverse of sender_partition_rows: the first `big_partition_count`
+    // partitions have `max_partition_size` rows, and the rest have one fewer.
+    size_t capacity = sender_bucket_capacity();
+    size_t partition_count = sender_partition_count();
+    assert(row < capacity);
+    size_t max_size = max_partition_size();
+    size_t big_partition_count = capacity - (max_size - 1) * partition_count;
+
+    if (row < big_partition_count * max_size) {
+        return row / max_size;
+    } else {
+        return big_partition_count + (row - big_partition_count * max_size) / (max_size - 1);
+    }
+}
+
 size_t PSIParams::window_size() {
     return window_size_;
 }
 
+size_t PSIParams::thread_count() {
+    return thread_count_;
+}
+
+bool PSIParams::ntt_evaluation() {
+    return ntt_evaluation_;
+}
+
+size_t PSIParams::ps_low_degree() {
+    return ps_low_degree_;
+}
+
+size_t PSIParams::query_depth() {
+    return query_depth_;
+}
+
+const vector<size_t> &PSIParams::sparse_query_powers() {
+    assert(query_depth_ > 0);
+    size_t max_power = max_query_power();
+    if ((sparse_query_powers_max_ != max_power) || (sparse_query_powers_depth_ != query_depth_)) {
+        sparse_query_powers_ = Windowing::sparse_powers(max_power, query_depth_);
+        sparse_query_powers_max_ = max_power;
+        sparse_query_powers_depth_ = query_depth_;
+    }
+    return sparse_query_powers_;
+}
+
+bool PSIParams::relin_free() {
+    return relin_free_;
+}
+
+size_t PSIParams::receiver_stash_size() {
+    return receiver_stash_size_;
+}
+
+bool PSIParams::receiver_seed_retry() {
+    return receiver_seed_retry_;
+}
+
+size_t PSIParams::mask_pool_size() {
+    return mask_pool_size_;
+}
+
+bool PSIParams::seeded_queries() {
+    return seeded_queries_;
+}
+
+bool PSIParams::seeded_keys() {
+    return seeded_keys_;
+}
+
+size_t PSIParams::max_query_power() {
+    size_t max_size = max_partition_size();
+    if ((ps_low_degree_ == 0) || (ps_low_degree_ > max_size)) {
+        return max_size;
+    }
+    return ps_low_degree_;
+}
+
 void PSIParams::set_sender_partition_count(size_t new_value) {
     sender_partition_count_ = new_value;
 }
@@ -170,6 +492,56 @@ void PSIParams::set_window_size(size_t new_value) {
     window_size_ = new_value;
 }
 
+void PSIParams::set_thread_count(size_t new_value) {
+    assert(new_value > 0);
+    thread_count_ = new_value;
+}
+
+void PSIParams::set_ntt_evaluation(bool new_value) {
+    ntt_evaluation_ = new_value;
+}
+
+void PSIParams::set_ps_low_degree(size_t new_value) {
+    if (relin_free_ && (new_value > 0)) {
+        throw runtime_error("Paterson-Stockmeyer can't be used in relin-free mode");
+    }
+    ps_low_degree_ = new_value;
+}
+
+void PSIParams::set_query_depth(size_t new_value) {
+    if (relin_free_ && (new_value > 0)) {
+        throw runtime_error("a query depth can't be used in relin-free mode");
+    }
+    query_depth_ = new_value;
+}
+
+void PSIParams::set_relin_free(bool new_value) {
+    if (new_value && ((ps_low_degree_ > 0) || (query_depth_ > 0))) {
+        throw runtime_error("relin-free mode can't be used with Paterson-Stockmeyer or a query depth");
+    }
+    relin_free_ = new_value;
+}
+
+void PSIParams::set_receiver_stash_size(size_t new_value) {
+    receiver_stash_size_ = new_value;
+}
+
+void PSIParams::set_receiver_seed_retry(bool new_value) {
+    receiver_seed_retry_ = new_value;
+}
+
+void PSIParams::set_mask_pool_size(size_t new_value) {
+    mask_pool_size_ = new_value;
+}
+
+void PSIParams::set_seeded_queries(bool new_value) {
+    seeded_queries_ = new_value;
+}
+
+void PSIParams::set_seeded_keys(bool new_value) {
+    seeded_keys_ = new_value;
+}
+
 
 uint64_t PSIParams::encode_bucket_element(vector<uint64_t> &inputs, bucket_slot &element, bool is_receiver) {
     uint64_t result;
@@ -192,16 +564,36 @@ uint64_t PSIParams::encode_bucket_element(vector<uint64_t> &inputs, bucket_slot
     return result;
 }
 
+uint64_t PSIParams::encode_sender_slot(vector<uint64_t> &inputs, packed_slot slot) {
+    // same encoding as encode_bucket_element. the sender's dummy element is
+    // 3, which is also the hash function index of an empty packed slot.
+    uint64_t result = 3;
+    if (slot != PACKED_SLOT_EMPTY) {
+        result = (((inputs[slot_input_index(slot)] >> bucket_count_log()) << 2)
+                  | slot_seed_index(slot));
+    }
+    assert(result < plain_modulus());
+    return result;
+}
+
 
 PSIReceiver::PSIReceiver(PSIParams &params)
     : params(params),
       keygen(params.context),
       public_key_(keygen.public_key()),
-      secret_key(keygen.secret_key())
+      secret_key(keygen.secret_key()),
+      seed_retries_(0)
 {
 #ifdef DEBUG_WITH_KEY_LEAK
     receiver_key_leaked = &secret_key;
 #endif
+
+    if (params.seeded_keys()) {
+        auto random_factory = UniformRandomGeneratorFactory::default_factory();
+        public_key_seed_ = random_seed(random_factory->create());
+        AESRandom expander(public_key_seed_.first, public_key_seed_.second);
+        reseed_key_ciphertext(params.context, secret_key, expander, public_key_.data());
+    }
 }
 
 vector<Ciphertext> PSIReceiver::encrypt_inputs(vector<uint64_t> &inputs, vector<bucket_slot> &buckets)
@@ -218,24 +610,60 @@ vector<Ciphertext> PSIReceiver::encrypt_inputs(vector<uint64_t> &inputs, vector<
 
     size_t bucket_count_log = params.bucket_count_log();
     size_t bucket_count = 1 << bucket_count_log;
-    bool res = cuckoo_hash(random, inputs, bucket_count_log, buckets, params.seeds);
-    assert(res); // TODO: handle gracefully
+    seed_retries_ = 0;
+    while (!cuckoo_hash(random, inputs, bucket_count_log, buckets, params.seeds,
+                        stash_, params.receiver_stash_size())) {
+        // the seeds belong to the sender, so we can only pick new ones if it
+        // hasn't hashed its set yet. otherwise, the table has lost an input,
+        // and a query without it would silently give the wrong result.
+        if (!params.receiver_seed_retry()) {
+            throw runtime_error("the receiver's set doesn't fit into the cuckoo hash table and stash");
+        }
+        params.generate_seeds();
+        seed_retries_++;
+    }
 
     vector<uint64_t> buckets_enc(bucket_count);
-    size_t partition_count = params.sender_partition_count();
-    size_t max_partition_size = (params.sender_bucket_capacity() + (partition_count - 1)) / partition_count;
-    Windowing windowing(params.window_size(), max_partition_size);
+    Windowing windowing = query_windowing(params);
 
     for (size_t i = 0; i < bucket_count; i++) {
         buckets_enc[i] = params.encode_bucket_element(inputs, buckets[i], true);
     }
 
     vector<Ciphertext> result;
-    windowing.prepare(buckets_enc, result, plain_modulus, encoder, encryptor);
+    query_seeds_.clear();
+    if (params.seeded_queries()) {
+        SeededEncryptor seeded_encryptor(params.context, secret_key);
+        windowing.prepare(buckets_enc, result, plain_modulus, encoder,
+                          [&](const Plaintext &plain, Ciphertext &destination) {
+                              seeded_encryptor.encrypt(plain, destination);
+                          });
+        query_seeds_ = seeded_encryptor.seeds();
+    } else {
+        windowing.prepare(buckets_enc, result, plain_modulus, encoder,
+                          [&](const Plaintext &plain, Ciphertext &destination) {
+                              encryptor.encrypt(plain, destination);
+                          });
+    }
 
     return result;
 }
 
+vector<size_t> &PSIReceiver::stash()
+{
+    return stash_;
+}
+
+size_t PSIReceiver::seed_retries()
+{
+    return seed_retries_;
+}
+
+vector<pair<uint64_t, uint64_t>> &PSIReceiver::query_seeds()
+{
+    return query_seeds_;
+}
+
 vector<size_t> PSIReceiver::decrypt_matches(vector<Ciphertext> &encrypted_matches)
 {
     Decryptor decryptor(params.context, secret_key);
@@ -297,200 +725,884 @@ PublicKey& PSIReceiver::public_key()
 
 RelinKeys PSIReceiver::relin_keys()
 {
-    return keygen.relin_keys(8);
+    RelinKeys keys = keygen.relin_keys(8);
+    if (params.seeded_keys()) {
+        auto random_factory = UniformRandomGeneratorFactory::default_factory();
+        relin_keys_seed_ = random_seed(random_factory->create());
+        AESRandom expander(relin_keys_seed_.first, relin_keys_seed_.second);
+        for (auto &key : keys.data()) {
+            for (auto &ciphertext : key) {
+                reseed_key_ciphertext(params.context, secret_key, expander, ciphertext);
+            }
+        }
+    }
+    return keys;
 }
 
-PSISender::PSISender(PSIParams &params)
-    : params(params)
-{}
+pair<uint64_t, uint64_t> PSIReceiver::public_key_seed()
+{
+    return public_key_seed_;
+}
 
-vector<Ciphertext> PSISender::compute_matches(vector<uint64_t> &inputs,
-                                              optional<vector<uint64_t>> &labels,
-                                              PublicKey& receiver_public_key,
-                                              RelinKeys relin_keys,
-                                              vector<Ciphertext> &receiver_inputs)
+pair<uint64_t, uint64_t> PSIReceiver::relin_keys_seed()
 {
-    assert(inputs.size() == params.sender_size);
-    assert(!labels.has_value() || (labels.value().size() == inputs.size()));
+    return relin_keys_seed_;
+}
 
-    auto random_factory = UniformRandomGeneratorFactory::default_factory();
-    auto random = random_factory->create();
+PSISenderDB::PSISenderDB(PSIParams &params,
+                         vector<uint64_t> &inputs,
+                         optional<vector<uint64_t>> &labels)
+    : params(params),
+      labeled(labels.has_value()),
+      ntt_form(params.ntt_evaluation()),
+      plaintext_size(sender_db_plaintext_size(params)),
+      mapping(nullptr),
+      mapping_size(0)
+{
+    assert(inputs.size() == params.sender_size);
+    assert(!labeled || (labels.value().size() == inputs.size()));
 
-    uint64_t plain_modulus = params.plain_modulus();
+    // we keep our own copy of the set and of the hash table, so that the DB
+    // can be updated later.
+    inputs_ = inputs;
+    if (labeled) {
+        labels_ = labels.value();
+    }
 
-    Encryptor encryptor(params.context, receiver_public_key);
-    BatchEncoder encoder(params.context);
-    Evaluator evaluator(params.context);
+    auto random_factory = UniformRandomGeneratorFactory::default_factory();
+    random = random_factory->create();
 
     // hash all of the sender's inputs, using every possible hash function, into
     // a (capacity × bucket_count) hash table.
     size_t bucket_count_log = params.bucket_count_log();
     size_t bucket_count = (1 << bucket_count_log);
     size_t capacity = params.sender_bucket_capacity();
-    vector<bucket_slot> buckets;
-    bool res = complete_hash(random, inputs, bucket_count_log, capacity, buckets, params.seeds);
-    assert(res); // TODO: handle gracefully
+    // the capacity is picked so that this practically never fails, but if it
+    // does, the table has lost inputs, and queries would silently miss them.
+    // the seeds are shared with the receiver, so we can't pick new ones here.
+    if (!complete_hash(random, inputs_, bucket_count_log, capacity, buckets,
+                       params.seeds, params.thread_count())) {
+        throw runtime_error("the sender's set doesn't fit into the hash table with these seeds");
+    }
 
-    // we will split the hash table into partitions: instead of looking at a
-    // hash table with `capacity` rows, split it into `partition_count` tables
-    // with roughly the same number of rows each.
-    // specifically, `big_partition_count` subtables will have
-    // `max_partition_size` rows, and the rest will have one fewer.
     size_t partition_count = params.sender_partition_count();
-    assert(capacity >= partition_count);
-    size_t max_partition_size = (capacity + (partition_count - 1)) / partition_count;
-    size_t big_partition_count = capacity - (max_partition_size - 1) * partition_count;
+    size_t max_partition_size = params.max_partition_size();
+    // every partition has one more coefficient than it has rows
+    size_t plaintext_count = (capacity + partition_count) * (labeled ? 2 : 1);
+    owned_data.resize(plaintext_count * plaintext_size);
+    data = owned_data.data();
+    f_coeffs_.resize((capacity + partition_count) * bucket_count);
+    g_coeffs_.resize(labeled ? f_coeffs_.size() : 0);
+
+    // partitions are independent of each other, so we hand them out to
+    // `thread_count` workers, and worker t processes partitions t,
+    // t + thread_count, t + 2 * thread_count, ...
+    size_t thread_count = min(params.thread_count(), partition_count);
+
+    run_workers(thread_count, [&](size_t thread_index) {
+        BatchEncoder encoder(params.context);
+        Evaluator evaluator(params.context);
+        uint64_t plain_modulus = params.plain_modulus();
+
+        // we'll need these vectors for each iteration, so let's declare them
+        // here to avoid reallocating them anew each time. all of them are
+        // laid out coefficient-major: entry (j, bucket) is at
+        // j * bucket_count + bucket, so that the polynomials of all buckets are
+        // built in lockstep, and the jth coefficients of all of them are
+        // exactly the slots of the jth plaintext.
+        vector<uint64_t> roots(max_partition_size * bucket_count);
+        vector<uint64_t> f_coeffs;
+        // we'll only need these if we're doing labeled PSI, so we set the
+        // sizes to 0 if we aren't to avoid unnecessarily wasting memory
+        vector<uint64_t> label_roots(labeled ? max_partition_size * bucket_count : 0);
+        vector<uint64_t> root_labels(labeled ? max_partition_size * bucket_count : 0);
+        vector<size_t> label_counts(labeled ? bucket_count : 0);
+        vector<uint64_t> g_coeffs;
+
+        for (size_t partition = thread_index; partition < partition_count; partition += thread_count) {
+            size_t partition_size, partition_start;
+            params.sender_partition_rows(partition, partition_start, partition_size);
+            roots.resize(partition_size * bucket_count);
+
+            // f_b(x) = \prod_{y in bucket b} (x - y), and optionally g_b(x),
+            // which has the property g_b(y) = label(y) for each (non-dummy) y
+            // in bucket b.
+            // the hash table is row-major, so this partition's slots are
+            // contiguous and already laid out like roots.
+            const packed_slot *partition_slots = &buckets[complete_hash_index(bucket_count_log, 0, partition_start)];
+            fill(label_counts.begin(), label_counts.end(), 0);
+            for (size_t k = 0; k < partition_size; k++) {
+                for (size_t b = 0; b < bucket_count; b++) {
+                    packed_slot slot = partition_slots[k * bucket_count + b];
+                    uint64_t root = params.encode_sender_slot(inputs_, slot);
+                    roots[k * bucket_count + b] = root;
+
+                    if (labeled && (slot != PACKED_SLOT_EMPTY)) {
+                        size_t index = label_counts[b] * bucket_count + b;
+                        label_roots[index] = root;
+                        root_labels[index] = labels_[slot_input_index(slot)];
+                        label_counts[b]++;
+                    }
+                }
+            }
 
-    Windowing windowing(params.window_size(), max_partition_size);
+            polynomials_from_roots_lockstep(roots, bucket_count, f_coeffs, plain_modulus);
+            if (labeled) {
+                label_roots.resize(partition_size * bucket_count);
+                root_labels.resize(partition_size * bucket_count);
+                polynomials_from_points_lockstep(label_roots, root_labels, label_counts,
+                                                 g_coeffs, plain_modulus);
+            }
 
-    // if we're doing labeled PSI, we need two ciphertexts per partition:
-    // one for f(x) and one for r*f(x) + g(x)
-    vector<Ciphertext> result((labels.has_value() ? 2 : 1) * partition_count);
-
-    // compute all the powers of the receiver's input.
-    vector<Ciphertext> powers(max_partition_size + 1);
-    windowing.compute_powers(receiver_inputs, powers, evaluator, relin_keys);
-
-    // we'll need these vectors for each iteration, so let's declare them here
-    // to avoid reallocating them anew each time.
-    vector<uint64_t> current_bucket(max_partition_size);
-    vector<vector<uint64_t>> f_coeffs(bucket_count);
-    // we'll only need these if we're doing labeled PSI, so we set the sizes to
-    // 0 if we aren't to avoid unnecessarily wasting memory
-    vector<uint64_t> current_labels(labels.has_value() ? max_partition_size : 0);
-    vector<vector<uint64_t>> g_coeffs(labels.has_value() ? bucket_count : 0);
-
-    for (size_t partition = 0; partition < partition_count; partition++) {
-        // figure out which many rows go into this partition
-        size_t partition_size, partition_start;
-        if (partition < big_partition_count) {
-            partition_size = max_partition_size;
-            partition_start = max_partition_size * partition;
-        } else {
-            partition_size = max_partition_size - 1;
-            partition_start = max_partition_size * partition - (partition - big_partition_count);
+            // keep the coefficients around for updates. g's top coefficient
+            // stays 0.
+            size_t first = coefficient_index(partition, 0, 0);
+            copy_n(f_coeffs.begin(), (partition_size + 1) * bucket_count, &f_coeffs_[first]);
+            if (labeled) {
+                copy_n(g_coeffs.begin(), partition_size * bucket_count, &g_coeffs_[first]);
+            }
+
+            // encode the jth coefficients of all polynomials into a plaintext
+            Plaintext f_coeffs_enc, g_coeffs_enc;
+            for (size_t j = 0; j < partition_size + 1; j++) {
+                f_coeffs_enc.parms_id() = parms_id_zero;
+                f_coeffs_enc.resize(bucket_count);
+                copy_n(&f_coeffs[j * bucket_count], bucket_count, f_coeffs_enc.data());
+                encoder.encode(f_coeffs_enc);
+                store_plaintext(f_coeffs_enc, partition, j, false, evaluator);
+
+                if (labeled) {
+                    // g has degree < partition_size, so its top coefficient
+                    // is always 0
+                    g_coeffs_enc.parms_id() = parms_id_zero;
+                    g_coeffs_enc.resize(bucket_count);
+                    if (j < partition_size) {
+                        copy_n(&g_coeffs[j * bucket_count], bucket_count, g_coeffs_enc.data());
+                    } else {
+                        fill_n(g_coeffs_enc.data(), bucket_count, 0);
+                    }
+                    encoder.encode(g_coeffs_enc);
+                    store_plaintext(g_coeffs_enc, partition, j, true, evaluator);
+                }
+            }
         }
+    });
+}
 
-        // for each bucket, compute the coefficients of the polynomial
-        // f(x) = \prod_{y in bucket} (x - y)
-        // optionally, also compute coeffs of g(x), which has the property
-        // g(y) = label(y) for each y in bucket.
-        for (size_t j = 0; j < bucket_count; j++) {
-            current_bucket.resize(partition_size);
-            for (size_t k = 0; k < partition_size; k++) {
-                current_bucket[k] = params.encode_bucket_element(
-                    inputs,
-                    buckets[j * capacity + partition_start + k],
-                    false
-                );
+void PSISenderDB::store_plaintext(Plaintext &plain,
+                                  size_t partition,
+                                  size_t j,
+                                  bool is_g,
+                                  Evaluator &evaluator)
+{
+    // in NTT mode, all but the constant coefficients are transformed right
+    // away, so that queries never have to do it.
+    if (ntt_form && (j > 0)) {
+        evaluator.transform_to_ntt_inplace(plain, params.context->first_parms_id());
+    }
+    assert(plain.coeff_count() <= plaintext_size);
+    copy_n(plain.data(), plain.coeff_count(), plaintext_data(partition, j, is_g));
+}
+
+bool PSISenderDB::insert(uint64_t input, uint64_t label)
+{
+    // mapped DBs are read-only.
+    assert(mapping == nullptr);
+
+    vector<size_t> slot_indices;
+    if (find_slots(input, slot_indices)) {
+        // already in the set
+        return false;
+    }
+    if (free_inputs.empty() && (inputs_.size() >= PACKED_SLOT_MAX_INPUTS)) {
+        // packed slots can't address another input
+        return false;
+    }
+
+    size_t m = params.bucket_count_log();
+    size_t capacity = params.sender_bucket_capacity();
+    vector<AES> aes(params.seeds.size());
+    for (size_t i = 0; i < params.seeds.size(); i++) {
+        aes[i].set_key(0, params.seeds[i]);
+    }
+
+    // for each hash function, pick a uniformly random empty slot in the
+    // bucket that the input hashes to (as in complete_hash, the position of
+    // an element within its bucket must not leak anything). two hash
+    // functions might pick the same bucket, so we must not pick a slot twice.
+    // we pick all the slots before touching anything, so that a full bucket
+    // leaves the DB unchanged.
+    slot_indices.clear();
+    vector<size_t> empty_slots;
+    for (size_t i = 0; i < params.seeds.size(); i++) {
+        size_t bucket = loc_aes_hash(aes[i], m, input);
+        empty_slots.clear();
+        for (size_t row = 0; row < capacity; row++) {
+            size_t slot_index = complete_hash_index(m, bucket, row);
+            if ((buckets[slot_index] == PACKED_SLOT_EMPTY)
+                && (find(slot_indices.begin(), slot_indices.end(), slot_index) == slot_indices.end())) {
+                empty_slots.push_back(slot_index);
+            }
+        }
+        if (empty_slots.empty()) {
+            return false;
+        }
+        slot_indices.push_back(empty_slots[random_integer(random, empty_slots.size())]);
+    }
+
+    // reuse the index of a removed input if there is one, so that a DB that
+    // sees as many removals as insertions doesn't grow.
+    size_t input_index;
+    if (!free_inputs.empty()) {
+        input_index = free_inputs.back();
+        free_inputs.pop_back();
+        inputs_[input_index] = input;
+        if (labeled) {
+            labels_[input_index] = label;
+        }
+    } else {
+        input_index = inputs_.size();
+        inputs_.push_back(input);
+        if (labeled) {
+            labels_.push_back(label);
+        }
+    }
+
+    vector<packed_slot> new_slots;
+    for (size_t i = 0; i < slot_indices.size(); i++) {
+        new_slots.push_back(pack_slot(input_index, i));
+    }
+    update_slots(slot_indices, new_slots);
+    return true;
+}
+
+bool PSISenderDB::remove(uint64_t input)
+{
+    // mapped DBs are read-only.
+    assert(mapping == nullptr);
+
+    vector<size_t> slot_indices;
+    if (!find_slots(input, slot_indices)) {
+        return false;
+    }
+    size_t input_index = slot_input_index(buckets[slot_indices[0]]);
+    vector<packed_slot> new_slots(slot_indices.size(), PACKED_SLOT_EMPTY);
+    update_slots(slot_indices, new_slots);
+    free_inputs.push_back(input_index);
+    return true;
+}
+
+bool PSISenderDB::find_slots(uint64_t input, vector<size_t> &slot_indices)
+{
+    size_t m = params.bucket_count_log();
+    size_t capacity = params.sender_bucket_capacity();
+    slot_indices.clear();
+
+    for (size_t i = 0; i < params.seeds.size(); i++) {
+        AES aes;
+        aes.set_key(0, params.seeds[i]);
+        size_t bucket = loc_aes_hash(aes, m, input);
+        for (size_t row = 0; row < capacity; row++) {
+            size_t slot_index = complete_hash_index(m, bucket, row);
+            packed_slot slot = buckets[slot_index];
+            if ((slot != PACKED_SLOT_EMPTY)
+                && (slot_seed_index(slot) == i)
+                && (inputs_[slot_input_index(slot)] == input)) {
+                slot_indices.push_back(slot_index);
+                break;
+            }
+        }
+    }
+
+    assert(slot_indices.empty() || (slot_indices.size() == params.seeds.size()));
+    return !slot_indices.empty();
+}
+
+void PSISenderDB::update_slots(const vector<size_t> &slot_indices, const vector<packed_slot> &new_slots)
+{
+    assert(slot_indices.size() == new_slots.size());
+    uint64_t plain_modulus = params.plain_modulus();
+    size_t m = params.bucket_count_log();
+
+    // the buckets whose polynomials change, with their coefficients from
+    // before the update. two slots can be in the same bucket, in which case
+    // we update its polynomials twice but only patch the plaintexts once.
+    struct changed_bucket {
+        size_t partition;
+        size_t bucket;
+        vector<uint64_t> old_f;
+        vector<uint64_t> old_g;
+    };
+    vector<changed_bucket> changed;
+    for (size_t i = 0; i < slot_indices.size(); i++) {
+        size_t bucket = slot_indices[i] & ((1ull << m) - 1);
+        size_t partition = params.sender_row_partition(slot_indices[i] >> m);
+        bool seen = false;
+        for (auto &c : changed) {
+            seen |= ((c.partition == partition) && (c.bucket == bucket));
+        }
+        if (!seen) {
+            size_t partition_start, partition_size;
+            params.sender_partition_rows(partition, partition_start, partition_size);
+            changed_bucket c = {partition, bucket, vector<uint64_t>(partition_size + 1), {}};
+            for (size_t j = 0; j < partition_size + 1; j++) {
+                c.old_f[j] = f_coeffs_[coefficient_index(partition, j, bucket)];
+            }
+            if (labeled) {
+                c.old_g.resize(partition_size + 1);
+                for (size_t j = 0; j < partition_size + 1; j++) {
+                    c.old_g[j] = g_coeffs_[coefficient_index(partition, j, bucket)];
+                }
             }
+            changed.push_back(move(c));
+        }
+        update_slot(slot_indices[i], new_slots[i]);
+    }
 
-            polynomial_from_roots(current_bucket, f_coeffs[j], plain_modulus);
-            assert(f_coeffs[j].size() == partition_size + 1);
-
-            if (labels.has_value()) {
-                current_labels.resize(partition_size);
-                size_t nonempty_slots = 0;
-                for (size_t k = 0; k < partition_size; k++) {
-                    size_t slot_index = j * capacity + partition_start + k;
-                    if (buckets[slot_index] != BUCKET_EMPTY) {
-                        current_bucket[nonempty_slots] = current_bucket[k];
-                        current_labels[nonempty_slots] = labels.value()[buckets[slot_index].first];
-                        nonempty_slots++;
+    // batch encoding is linear, so instead of re-encoding every coefficient
+    // of every bucket, we can add (new - old) times the encoding of the unit
+    // vector for a bucket to each coefficient plaintext. each plaintext is
+    // loaded and stored at most once, however many of its buckets changed.
+    BatchEncoder encoder(params.context);
+    Evaluator evaluator(params.context);
+    vector<Plaintext> unit_encs(changed.size());
+    for (size_t c = 0; c < changed.size(); c++) {
+        vector<uint64_t> unit(encoder.slot_count(), 0);
+        unit[changed[c].bucket] = 1;
+        encoder.encode(unit, unit_encs[c]);
+    }
+
+    Plaintext plain;
+    for (size_t partition = 0; partition < params.sender_partition_count(); partition++) {
+        size_t partition_start, partition_size;
+        params.sender_partition_rows(partition, partition_start, partition_size);
+        for (size_t j = 0; j < partition_size + 1; j++) {
+            for (bool is_g : {false, true}) {
+                if (is_g && !labeled) {
+                    continue;
+                }
+                vector<uint64_t> &coeffs = is_g ? g_coeffs_ : f_coeffs_;
+                bool loaded = false;
+                for (size_t c = 0; c < changed.size(); c++) {
+                    if (changed[c].partition != partition) {
+                        continue;
+                    }
+                    uint64_t old_coeff = is_g ? changed[c].old_g[j] : changed[c].old_f[j];
+                    uint64_t new_coeff = coeffs[coefficient_index(partition, j, changed[c].bucket)];
+                    uint64_t delta = (new_coeff + plain_modulus - old_coeff) % plain_modulus;
+                    if (delta == 0) {
+                        continue;
+                    }
+                    if (!loaded) {
+                        load_coefficient_form(partition, j, is_g, plain);
+                        loaded = true;
+                    }
+                    for (size_t i = 0; i < params.poly_modulus_degree(); i++) {
+                        plain[i] = (plain[i] + MUL_MOD(delta, unit_encs[c][i], plain_modulus)) % plain_modulus;
                     }
                 }
+                if (loaded) {
+                    store_plaintext(plain, partition, j, is_g, evaluator);
+                }
+            }
+        }
+    }
+}
+
+void PSISenderDB::update_slot(size_t slot_index, packed_slot new_slot)
+{
+    uint64_t plain_modulus = params.plain_modulus();
+    size_t m = params.bucket_count_log();
+    size_t bucket = slot_index & ((1ull << m) - 1);
+    size_t partition = params.sender_row_partition(slot_index >> m);
+    size_t partition_start, partition_size;
+    params.sender_partition_rows(partition, partition_start, partition_size);
+    packed_slot old_slot = buckets[slot_index];
+
+    vector<uint64_t> f(partition_size + 1);
+    for (size_t j = 0; j < partition_size + 1; j++) {
+        f[j] = f_coeffs_[coefficient_index(partition, j, bucket)];
+    }
+
+    // f only changes by one root.
+    polynomial_replace_root(f,
+                            params.encode_sender_slot(inputs_, old_slot),
+                            params.encode_sender_slot(inputs_, new_slot),
+                            plain_modulus);
+    for (size_t j = 0; j < partition_size + 1; j++) {
+        f_coeffs_[coefficient_index(partition, j, bucket)] = f[j];
+    }
+
+    // g loses the point of the old slot and gains the one of the new slot,
+    // if they aren't empty. both only need the product of (x - y) over the
+    // other non-empty slots of the bucket.
+    if (labeled && ((old_slot != PACKED_SLOT_EMPTY) || (new_slot != PACKED_SLOT_EMPTY))) {
+        vector<uint64_t> g(partition_size + 1);
+        for (size_t j = 0; j < partition_size + 1; j++) {
+            g[j] = g_coeffs_[coefficient_index(partition, j, bucket)];
+        }
+
+        vector<uint64_t> other_roots, others;
+        for (size_t k = 0; k < partition_size; k++) {
+            size_t other_index = complete_hash_index(m, bucket, partition_start + k);
+            if ((other_index != slot_index) && (buckets[other_index] != PACKED_SLOT_EMPTY)) {
+                other_roots.push_back(params.encode_sender_slot(inputs_, buckets[other_index]));
+            }
+        }
+        polynomial_from_roots(other_roots, others, plain_modulus);
+
+        if (old_slot != PACKED_SLOT_EMPTY) {
+            polynomial_remove_point(g, others, plain_modulus);
+        }
+        if (new_slot != PACKED_SLOT_EMPTY) {
+            polynomial_add_point(g, others,
+                                 params.encode_sender_slot(inputs_, new_slot),
+                                 labels_[slot_input_index(new_slot)],
+                                 plain_modulus);
+        }
+        for (size_t j = 0; j < partition_size + 1; j++) {
+            g_coeffs_[coefficient_index(partition, j, bucket)] = g[j];
+        }
+    }
+
+    buckets[slot_index] = new_slot;
+}
 
-                current_bucket.resize(nonempty_slots);
-                current_labels.resize(nonempty_slots);
-                polynomial_from_points(current_bucket, current_labels, g_coeffs[j], plain_modulus);
+size_t PSISenderDB::coefficient_index(size_t partition, size_t j, size_t bucket)
+{
+    // the same layout as the plaintexts, without the interleaving of f and g
+    size_t partition_start, partition_size;
+    params.sender_partition_rows(partition, partition_start, partition_size);
+    return ((partition_start + partition + j) << params.bucket_count_log()) + bucket;
+}
+
+void PSISenderDB::load_coefficient_form(size_t partition, size_t j, bool is_g, Plaintext &destination)
+{
+    uint64_t plain_modulus = params.plain_modulus();
+    size_t coeff_count = params.poly_modulus_degree();
+    destination.parms_id() = parms_id_zero;
+    destination.resize(coeff_count);
+    copy_n(plaintext_data(partition, j, is_g), coeff_count, destination.data());
+
+    if (ntt_form && (j > 0)) {
+        // the plaintext's first coeff_count words are the NTT (modulo the
+        // first coefficient modulus prime q) of its coefficients, lifted from
+        // [0, t) to (-t/2, t/2) the way SEAL lifts plaintexts. since t is much
+        // smaller than q, undoing the transform gives back that lift exactly.
+        auto context_data = params.context->context_data(params.context->first_parms_id());
+        uint64_t q = context_data->parms().coeff_modulus()[0].value();
+        util::inverse_ntt_negacyclic_harvey(destination.data(), context_data->small_ntt_tables()[0]);
+        for (size_t i = 0; i < coeff_count; i++) {
+            if (destination[i] >= q - plain_modulus) {
+                destination[i] -= (q - plain_modulus);
             }
         }
+    }
+}
 
-        // we are done with sender's precomputation. now we can actually
-        // evaluate the polynomial on the receiver's input.
-        Ciphertext f_evaluated;
-        Ciphertext g_evaluated;
+PSISenderDB::PSISenderDB(PSIParams &params, const string &path)
+    : params(params),
+      ntt_form(params.ntt_evaluation()),
+      plaintext_size(sender_db_plaintext_size(params))
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("can't open " + path);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        throw runtime_error("can't stat " + path);
+    }
+    mapping_size = file_stat.st_size;
+    if (mapping_size < SENDER_DB_HEADER_SIZE) {
+        close(fd);
+        throw runtime_error(path + " is too small to be a sender DB");
+    }
+
+    // a shared, read-only mapping: every process that maps this file reads
+    // the same pages of the page cache.
+    mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw runtime_error("can't map " + path);
+    }
+
+    sender_db_header header;
+    memcpy(&header, mapping, sizeof(header));
+    labeled = (header.labeled != 0);
+    // the destructor doesn't run if the constructor throws, so we have to
+    // unmap the file ourselves.
+    try {
+        check_sender_db_header(header);
+        check_sender_db_params(header, params);
+        // everything we read later is at an offset computed from params, so
+        // the file must be exactly that layout, and complete.
+        size_t data_size = sender_db_data_size(params, labeled);
+        if (header.data_size != data_size) {
+            throw runtime_error("the sender DB's size doesn't match its params");
+        }
+        if (SENDER_DB_HEADER_SIZE + data_size * sizeof(uint64_t) > mapping_size) {
+            throw runtime_error(path + " is truncated");
+        }
+    } catch (...) {
+        munmap(mapping, mapping_size);
+        throw;
+    }
+
+    // we only ever read through this pointer.
+    data = (uint64_t *) ((char *) mapping + SENDER_DB_HEADER_SIZE);
+}
+
+PSISenderDB::~PSISenderDB()
+{
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+PSIParams PSISenderDB::read_params(const string &path)
+{
+    ifstream file(path, ios::binary);
+    if (!file.good()) {
+        throw runtime_error("can't open " + path);
+    }
+    sender_db_header header;
+    file.read((char *) &header, sizeof(header));
+    if (!file.good()) {
+        throw runtime_error(path + " is too small to be a sender DB");
+    }
+    check_sender_db_header(header);
+
+    PSIParams params(0, header.sender_size, header.input_bits, header.poly_modulus_degree);
+    params.set_sender_partition_count(header.partition_count);
+    params.set_window_size(header.window_size);
+    params.set_ps_low_degree(header.ps_low_degree);
+    params.set_query_depth(header.query_depth);
+    params.set_ntt_evaluation(header.ntt_form != 0);
+    vector<uint64_t> seeds(header.seeds, header.seeds + params.hash_functions());
+    params.set_seeds(seeds);
+    // every partition needs at least one row
+    if ((header.partition_count == 0) || (header.partition_count > params.sender_bucket_capacity())) {
+        throw runtime_error("the sender DB has an invalid partition count");
+    }
+    return params;
+}
+
+void PSISenderDB::save(const string &path)
+{
+    assert(params.hash_functions() <= SENDER_DB_MAX_SEEDS);
+
+    sender_db_header header = {};
+    header.magic = SENDER_DB_MAGIC;
+    header.version = SENDER_DB_VERSION;
+    header.sender_size = params.sender_size;
+    header.input_bits = params.input_bits;
+    header.poly_modulus_degree = params.poly_modulus_degree();
+    header.partition_count = params.sender_partition_count();
+    header.window_size = params.window_size();
+    header.ps_low_degree = params.ps_low_degree();
+    header.query_depth = params.query_depth();
+    header.labeled = labeled ? 1 : 0;
+    header.ntt_form = ntt_form ? 1 : 0;
+    for (size_t i = 0; i < params.hash_functions(); i++) {
+        header.seeds[i] = params.seeds[i];
+    }
+    header.plaintext_size = plaintext_size;
+    header.data_size = sender_db_data_size(params, labeled);
+
+    // the header is padded to a page boundary, so that the data is page
+    // aligned when the file is mapped.
+    vector<char> header_bytes(SENDER_DB_HEADER_SIZE);
+    memcpy(header_bytes.data(), &header, sizeof(header));
+
+    ofstream file(path, ios::binary | ios::trunc);
+    assert(file.good());
+    file.write(header_bytes.data(), header_bytes.size());
+    file.write((const char *) data, header.data_size * sizeof(uint64_t));
+    assert(file.good());
+}
+
+bool PSISenderDB::is_labeled()
+{
+    return labeled;
+}
+
+bool PSISenderDB::is_ntt_form()
+{
+    return ntt_form;
+}
+
+void PSISenderDB::f_coeffs(size_t partition, size_t j, Plaintext &destination)
+{
+    load_plaintext(partition, j, false, destination);
+}
+
+void PSISenderDB::g_coeffs(size_t partition, size_t j, Plaintext &destination)
+{
+    assert(labeled);
+    load_plaintext(partition, j, true, destination);
+}
+
+const uint64_t *PSISenderDB::coeffs_data(size_t partition, size_t j, bool is_g)
+{
+    return plaintext_data(partition, j, is_g);
+}
+
+void PSISenderDB::load_plaintext(size_t partition, size_t j, bool is_g, Plaintext &destination)
+{
+    bool is_ntt = ntt_form && (j > 0);
+    size_t size = is_ntt ? plaintext_size : params.poly_modulus_degree();
+
+    // SEAL refuses to resize plaintexts in NTT form, so we clear the
+    // parms_id first and only set it once the coefficients are in place.
+    destination.parms_id() = parms_id_zero;
+    destination.resize(size);
+    copy_n(plaintext_data(partition, j, is_g), size, destination.data());
+    if (is_ntt) {
+        destination.parms_id() = params.context->first_parms_id();
+    }
+}
+
+uint64_t *PSISenderDB::plaintext_data(size_t partition, size_t j, bool is_g)
+{
+    size_t partition_start, partition_size;
+    params.sender_partition_rows(partition, partition_start, partition_size);
+    assert(j <= partition_size);
+    assert(!is_g || labeled);
+
+    // partitions before this one hold (partition_start + partition)
+    // coefficients in total, since each has one more than it has rows.
+    size_t index = partition_start + partition + j;
+    if (labeled) {
+        index = 2 * index + (is_g ? 1 : 0);
+    }
+    return data + index * plaintext_size;
+}
+
+PSISender::PSISender(PSIParams &params)
+    : params(params)
+{
+    if (params.mask_pool_size() > 0) {
+        mask_pool = make_unique<MaskPool>(params.context, params.mask_pool_size());
+    }
+}
+
+void PSISender::prepare_masks()
+{
+    if (mask_pool) {
+        mask_pool->wait_until_full();
+    }
+}
+
+vector<Ciphertext> PSISender::compute_matches(vector<uint64_t> &inputs,
+                                              optional<vector<uint64_t>> &labels,
+                                              PublicKey& receiver_public_key,
+                                              RelinKeys relin_keys,
+                                              vector<Ciphertext> &receiver_inputs)
+{
+    PSISenderDB db(params, inputs, labels);
+    return compute_matches(db, receiver_public_key, relin_keys, receiver_inputs);
+}
+
+vector<Ciphertext> PSISender::compute_matches(PSISenderDB &db,
+                                              PublicKey& receiver_public_key,
+                                              RelinKeys relin_keys,
+                                              vector<Ciphertext> &receiver_inputs)
+{
+    bool labeled = db.is_labeled();
+    uint64_t plain_modulus = params.plain_modulus();
+    size_t partition_count = params.sender_partition_count();
+    size_t max_partition_size = params.max_partition_size();
+
+    // keep the pool from refilling while we're busy
+    if (mask_pool) {
+        mask_pool->begin_query();
+    }
+
+    // we evaluate each polynomial of degree d in blocks of `block_size`
+    // coefficients (baby steps), which only need the powers up to
+    // `block_size`, and multiply the sum for each block by a giant power.
+    // that is, f(x) = c_0 + \sum_i x^{i * block_size} * f_i(x), where
+    // f_i(x) = \sum_{k = 1}^{block_size} c_{i * block_size + k} * x^k.
+    // without Paterson-Stockmeyer, there's just one block and no giant steps.
+    size_t block_size = params.max_query_power();
+    size_t block_count = (max_partition_size + block_size - 1) / block_size;
+
+    Evaluator evaluator(params.context);
+    Windowing windowing = query_windowing(params);
+    parms_id_type response_parms = response_parms_id(params);
+
+    // if we're doing labeled PSI, we need two ciphertexts per partition:
+    // one for f(x) and one for r*f(x) + g(x)
+    vector<Ciphertext> result((labeled ? 2 : 1) * partition_count);
+
+    // compute all the (baby step) powers of the receiver's input.
+    vector<Ciphertext> powers(block_size + 1);
+    windowing.compute_powers(receiver_inputs, powers, params.context, relin_keys, params.thread_count());
+
+    // compute the giant step powers x^{i * block_size}.
+    vector<Ciphertext> giant_powers(block_count);
+    compute_giant_powers(powers[block_size], giant_powers, evaluator, relin_keys);
+
+    // every power is transformed exactly once, here, instead of once for
+    // every product it takes part in. powers[0] is never used.
+    size_t power_thread_count = min(params.thread_count(), block_size);
+    run_workers(power_thread_count, [&](size_t thread_index) {
+        Evaluator evaluator(params.context);
+        for (size_t j = 1 + thread_index; j <= block_size; j += power_thread_count) {
+            evaluator.transform_to_ntt_inplace(powers[j]);
+        }
+    });
+    bool ntt_form = db.is_ntt_form();
+
+    // partitions are independent of each other: they only read `powers` and
+    // each writes to its own slots of `result`. so we hand them out to
+    // `thread_count` workers, and worker t processes partitions t,
+    // t + thread_count, t + 2 * thread_count, ...
+    size_t thread_count = min(params.thread_count(), partition_count);
+
+    run_workers(thread_count, [&](size_t thread_index) {
+        // SEAL's evaluator, encoder and encryptor are not meant to be shared
+        // between threads, and neither is the RNG, so each worker gets its own.
+        auto random_factory = UniformRandomGeneratorFactory::default_factory();
+        AESRandom random(random_factory->create());
+        Encryptor encryptor(params.context, receiver_public_key);
+        BatchEncoder encoder(params.context);
+        Evaluator evaluator(params.context);
+
+        for (size_t partition = thread_index; partition < partition_count; partition += thread_count) {
+            size_t partition_start, partition_size;
+            params.sender_partition_rows(partition, partition_start, partition_size);
+
+            // the sender's precomputation is already done. now we can
+            // actually evaluate the polynomial on the receiver's input.
+            Ciphertext f_evaluated;
+            Ciphertext g_evaluated;
+            Plaintext f_coeffs_enc, g_coeffs_enc;
+            Ciphertext f_block, g_block;
+            vector<const uint64_t*> f_block_coeffs, g_block_coeffs;
+            // outside of NTT mode, a block's plaintexts are transformed into
+            // these, once per query.
+            vector<Plaintext> f_block_plains(ntt_form ? 0 : block_size);
+            vector<Plaintext> g_block_plains((ntt_form || !labeled) ? 0 : block_size);
 
 #ifdef DEBUG_WITH_KEY_LEAK
-        Decryptor decryptor(params.context, *receiver_key_leaked);
-        cerr << "processing partition " << partition << endl;
+            Decryptor decryptor(params.context, *receiver_key_leaked);
+            cerr << "processing partition " << partition << endl;
 #endif
 
-        for (size_t j = 0; j < partition_size + 1; j++) {
-            // encode the jth coefficients of all polynomials into a vector
-            Plaintext f_coeffs_enc(bucket_count, bucket_count);
-            for (size_t k = 0; k < bucket_count; k++) {
-                f_coeffs_enc[k] = f_coeffs[k][j];
-            }
-            encoder.encode(f_coeffs_enc);
-
-            Plaintext g_coeffs_enc;
-            if (labels.has_value()) {
-                g_coeffs_enc.resize(bucket_count);
-                for (size_t k = 0; k < bucket_count; k++) {
-                    g_coeffs_enc[k] = (j < g_coeffs[k].size())
-                                         ? g_coeffs[k][j]
-                                         : 0;
-                }
-                encoder.encode(g_coeffs_enc);
+            // the constant term just goes straight into the result, and then
+            // the other terms will be added into it later.
+            db.f_coeffs(partition, 0, f_coeffs_enc);
+            encryptor.encrypt(f_coeffs_enc, f_evaluated);
+            if (labeled) {
+                db.g_coeffs(partition, 0, g_coeffs_enc);
+                encryptor.encrypt(g_coeffs_enc, g_evaluated);
             }
 
-            if (j == 0) {
-                // the constant term just goes straight into the result, and
-                // then the other terms will be added into it later.
-                encryptor.encrypt(f_coeffs_enc, f_evaluated);
-                if (labels.has_value()) {
-                    encryptor.encrypt(g_coeffs_enc, g_evaluated);
-                }
-            } else {
-                // term = receiver_inputs^j * f_coeffs_enc
-                // multiply_plain does not allow the second parameter to be zero.
-                if (!f_coeffs_enc.is_zero()) {
-                    Ciphertext term;
-                    evaluator.multiply_plain(powers[j], f_coeffs_enc, term);
-                    evaluator.relinearize_inplace(term, relin_keys);
-                    evaluator.add_inplace(f_evaluated, term);
+            for (size_t block = 0; block * block_size < partition_size; block++) {
+                // block_f = \sum_k receiver_inputs^k * f_coeffs[block_start + k]
+                size_t block_start = block * block_size;
+                size_t block_end = min(block_start + block_size, partition_size);
+
+                // zero plaintexts can stay in: their products are just zero,
+                // not an error as in multiply_plain.
+                f_block_coeffs.clear();
+                g_block_coeffs.clear();
+                for (size_t j = block_start + 1; j <= block_end; j++) {
+                    if (ntt_form) {
+                        f_block_coeffs.push_back(db.coeffs_data(partition, j, false));
+                        if (labeled) {
+                            g_block_coeffs.push_back(db.coeffs_data(partition, j, true));
+                        }
+                    } else {
+                        Plaintext &f_plain = f_block_plains[j - block_start - 1];
+                        db.f_coeffs(partition, j, f_plain);
+                        evaluator.transform_to_ntt_inplace(f_plain, powers[1].parms_id());
+                        f_block_coeffs.push_back(f_plain.data());
+                        if (labeled) {
+                            Plaintext &g_plain = g_block_plains[j - block_start - 1];
+                            db.g_coeffs(partition, j, g_plain);
+                            evaluator.transform_to_ntt_inplace(g_plain, powers[1].parms_id());
+                            g_block_coeffs.push_back(g_plain.data());
+                        }
+                    }
                 }
 
-                if (!g_coeffs_enc.is_zero()) {
-                    Ciphertext term;
-                    evaluator.multiply_plain(powers[j], g_coeffs_enc, term);
-                    evaluator.relinearize_inplace(term, relin_keys);
-                    evaluator.add_inplace(g_evaluated, term);
+                // move the block into place with its giant step and add it to
+                // the result. the products with the giant powers are not
+                // relinearized until the very end.
+                ntt_dot_product(params.context, &powers[1], f_block_coeffs, f_block);
+                evaluator.transform_from_ntt_inplace(f_block);
+                if (block > 0) {
+                    evaluator.multiply_inplace(f_block, giant_powers[block]);
+                }
+                evaluator.add_inplace(f_evaluated, f_block);
+                if (labeled) {
+                    ntt_dot_product(params.context, &powers[1], g_block_coeffs, g_block);
+                    evaluator.transform_from_ntt_inplace(g_block);
+                    if (block > 0) {
+                        evaluator.multiply_inplace(g_block, giant_powers[block]);
+                    }
+                    evaluator.add_inplace(g_evaluated, g_block);
                 }
-            }
 
 #ifdef DEBUG_WITH_KEY_LEAK
-        cerr << "after term " << j << " n.b. is " << decryptor.invariant_noise_budget(f_evaluated) << endl;
+                cerr << "after block " << block << " n.b. is " << decryptor.invariant_noise_budget(f_evaluated) << endl;
 #endif
-        }
+            }
+
+            // only the products with giant powers need relinearization, so
+            // without Paterson-Stockmeyer (and in particular in relin-free
+            // mode), the results are already small.
+            if (f_evaluated.size() > 2) {
+                evaluator.relinearize_inplace(f_evaluated, relin_keys);
+            }
+            if (labeled && (g_evaluated.size() > 2)) {
+                evaluator.relinearize_inplace(g_evaluated, relin_keys);
+            }
 
-        // for unlabeled PSI, return r * f(x)
-        // for labeled PSI, return (r * f(x), r' * f(x) + g(x))
-        // where r and r' are random.
-        multiply_by_random_mask(f_evaluated, random, encoder, evaluator, relin_keys, plain_modulus);
+            // for unlabeled PSI, return r * f(x)
+            // for labeled PSI, return (r * f(x), r' * f(x) + g(x))
+            // where r and r' are random.
+            multiply_by_random_mask(f_evaluated, mask_pool.get(), random, encoder, evaluator, plain_modulus);
 
 #ifdef DEBUG_WITH_KEY_LEAK
-        cerr << "after mask it is " << decryptor.invariant_noise_budget(f_evaluated) << endl;
+            cerr << "after mask it is " << decryptor.invariant_noise_budget(f_evaluated) << endl;
 #endif
 
-        if (labels.has_value()) {
-            result[2 * partition] = f_evaluated;
+            if (labeled) {
+                result[2 * partition] = f_evaluated;
 
-            multiply_by_random_mask(f_evaluated, random, encoder, evaluator, relin_keys, plain_modulus);
+                multiply_by_random_mask(f_evaluated, mask_pool.get(), random, encoder, evaluator, plain_modulus);
 
 #ifdef DEBUG_WITH_KEY_LEAK
-            cerr << "after second mask it is " << decryptor.invariant_noise_budget(f_evaluated) << endl;
+                cerr << "after second mask it is " << decryptor.invariant_noise_budget(f_evaluated) << endl;
 #endif
-            evaluator.add(f_evaluated, g_evaluated, result[2 * partition + 1]);
+                evaluator.add(f_evaluated, g_evaluated, result[2 * partition + 1]);
 
 #ifdef DEBUG_WITH_KEY_LEAK
-            cerr << "after final add it is " << decryptor.invariant_noise_budget(result[2 * partition + 1]) << endl;
+                cerr << "after final add it is " << decryptor.invariant_noise_budget(result[2 * partition + 1]) << endl;
 #endif
-        } else {
-            result[partition] = f_evaluated;
+            } else {
+                result[partition] = f_evaluated;
+            }
+
+            // the receiver only needs a little noise budget to decrypt, so we
+            // drop as many primes as we can before sending the results.
+            size_t result_start = (labeled ? 2 : 1) * partition;
+            for (size_t i = result_start; i < result_start + (labeled ? 2 : 1); i++) {
+                evaluator.mod_switch_to_inplace(result[i], response_parms);
+#ifdef DEBUG_WITH_KEY_LEAK
+                cerr << "after mod switching it is " << decryptor.invariant_noise_budget(result[i]) << endl;
+#endif
+            }
         }
-    }
+    });
 
+    if (mask_pool) {
+        mask_pool->end_query();
+    }
     return result;
 }
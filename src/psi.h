@@ -1,10 +1,13 @@
 #pragma once
-#include <vector>
+#include <memory>
 #include <optional>
+#include <string>
+#include <vector>
 
 #include "seal/seal.h"
 
 #include "hashing.h"
+#include "masks.h"
 
 using namespace std;
 using namespace seal;
@@ -14,20 +17,105 @@ class PSIParams
 public:
     PSIParams(size_t receiver_size, size_t sender_size, size_t input_bits, size_t poly_modulus_degree);
     // you *must* call either generate_seeds or set_seeds.
+    // the seeds belong to the sender's set: the sender generates them once,
+    // hashes its set with them, and announces them to every receiver.
     void generate_seeds();
     void set_seeds(vector<uint64_t> &seeds_ext);
 
+    size_t poly_modulus_degree();
     uint64_t plain_modulus();
     size_t hash_functions();
     size_t bucket_count_log();
     size_t sender_bucket_capacity();
     size_t sender_partition_count();
+    size_t max_partition_size();
+    // sets `start` and `size` to the first row of the sender's hash table that
+    // belongs to `partition`, and the number of rows in it.
+    void sender_partition_rows(size_t partition, size_t &start, size_t &size);
+    // the partition that a row of the sender's hash table belongs to.
+    size_t sender_row_partition(size_t row);
     size_t window_size();
+    size_t thread_count();
+    bool ntt_evaluation();
+    size_t ps_low_degree();
+    // the highest power of the receiver's input that the sender needs; the
+    // receiver's windows are chosen so that the sender can compute exactly the
+    // powers up to this one.
+    size_t max_query_power();
+    size_t query_depth();
+    // the powers that the receiver sends if query_depth() is nonzero (see
+    // Windowing::sparse_powers). finding them takes a while, so they're only
+    // found once for every max_query_power() and query_depth(), and then
+    // kept. like the setters, this must not be called concurrently.
+    const vector<size_t> &sparse_query_powers();
+    bool relin_free();
+    size_t receiver_stash_size();
+    bool receiver_seed_retry();
+    size_t mask_pool_size();
+    bool seeded_queries();
+    bool seeded_keys();
 
     void set_sender_partition_count(size_t new_value);
     void set_window_size(size_t new_value);
+    // the sender evaluates partitions on this many threads (1 by default)
+    void set_thread_count(size_t new_value);
+    // if set, the sender stores its coefficient plaintexts in NTT form. the
+    // polynomials are always evaluated in the NTT domain, so this saves
+    // transforming every plaintext for every query, at the cost of making
+    // the PSISenderDB (coeff_modulus size) times larger.
+    void set_ntt_evaluation(bool new_value);
+    // if nonzero, the sender evaluates its polynomials with the
+    // Paterson-Stockmeyer (baby-step giant-step) method: it only computes the
+    // powers up to this degree and a few giant powers. about
+    // sqrt(max_partition_size()) minimizes ciphertext multiplications.
+    // 0 (the default) disables it, and all powers up to max_partition_size()
+    // are computed with windowing.
+    void set_ps_low_degree(size_t new_value);
+    // if nonzero, the receiver doesn't send the windows given by
+    // window_size(), but the smallest set of powers that it found from which
+    // the sender can compute all powers up to max_query_power() with at most
+    // this multiplicative depth (see Windowing::sparse_powers). lower depths
+    // mean more powers to send, but fewer for the sender to compute.
+    // 0 (the default) disables it.
+    // this and set_ps_low_degree throw runtime_error for nonzero values if
+    // relin_free() is set.
+    void set_query_depth(size_t new_value);
+    // if set, the receiver sends every power of its input up to
+    // max_query_power() instead of windows. the sender then only multiplies
+    // ciphertexts by plaintexts, so it needs no relinearization keys, which
+    // are much bigger than the extra powers when partitions are small. this
+    // rules out Paterson-Stockmeyer, which multiplies ciphertexts, and a
+    // query depth, so setting it throws runtime_error if either is nonzero.
+    void set_relin_free(bool new_value);
+    // the receiver may leave up to this many inputs out of its cuckoo hash
+    // table (0 by default) when they can't be inserted without very long
+    // eviction chains. those inputs aren't part of the query: the receiver
+    // must query them separately, for example in a second, tiny query.
+    void set_receiver_stash_size(size_t new_value);
+    // if set, a receiver that can't cuckoo hash its set with the current
+    // seeds picks new ones (with generate_seeds) until it can. this only
+    // works if the sender hasn't hashed its set yet, e.g. when both run in
+    // the same process, and is off by default.
+    void set_receiver_seed_retry(bool new_value);
+    // if nonzero, the sender keeps a pool of up to this many random masks,
+    // which a background thread prepares between queries (see MaskPool), so
+    // that they're not made while answering one. a query takes one mask per
+    // partition, or two for labeled PSI; if the pool runs dry, the rest are
+    // made on the spot. 0 (the default) disables it.
+    void set_mask_pool_size(size_t new_value);
+    // if set, the receiver encrypts its query under its secret key, with
+    // seeded ciphertexts (see seeded.h), which take half as much space to
+    // send. off by default.
+    void set_seeded_queries(bool new_value);
+    // if set, the receiver's public and relinearization keys are made so that
+    // their random halves can be expanded from a seed (see seeded.h), which
+    // halves their size on the wire. off by default.
+    void set_seeded_keys(bool new_value);
 
     uint64_t encode_bucket_element(vector<uint64_t> &inputs, bucket_slot &element, bool is_receiver);
+    /* same as encode_bucket_element(inputs, element, false), for a slot of the
+       sender's packed hash table. */
+    uint64_t encode_sender_slot(vector<uint64_t> &inputs, packed_slot slot);
 
     size_t receiver_size;
     size_t sender_size;
@@ -39,35 +127,198 @@ private:
     size_t poly_modulus_degree_;
     size_t sender_partition_count_;
     size_t window_size_;
+    size_t thread_count_;
+    bool ntt_evaluation_;
+    size_t ps_low_degree_;
+    size_t query_depth_;
+    bool relin_free_;
+    size_t receiver_stash_size_;
+    bool receiver_seed_retry_;
+    size_t mask_pool_size_;
+    bool seeded_queries_;
+    bool seeded_keys_;
+    // the result of sparse_query_powers, and the max_query_power() and
+    // query_depth() it was found for
+    vector<size_t> sparse_query_powers_;
+    size_t sparse_query_powers_max_;
+    size_t sparse_query_powers_depth_;
 };
 
 class PSIReceiver
 {
 public:
     PSIReceiver(PSIParams &params);
+    /* throws runtime_error if the inputs can't be cuckoo hashed with at
+       most params.receiver_stash_size() of them in the stash, and
+       params.receiver_seed_retry() isn't set. */
     vector<Ciphertext> encrypt_inputs(vector<uint64_t> &inputs, vector<bucket_slot> &buckets);
+    // the indices of the inputs that the last call to encrypt_inputs put into
+    // the stash (see PSIParams::set_receiver_stash_size).
+    vector<size_t> &stash();
+    // how many times the last call to encrypt_inputs had to pick new seeds.
+    size_t seed_retries();
+    // if params.seeded_queries() is set, the seeds of the ciphertexts that
+    // the last call to encrypt_inputs returned, in the same order.
+    vector<pair<uint64_t, uint64_t>> &query_seeds();
     vector<size_t> decrypt_matches(vector<Ciphertext> &encrypted_matches);
     vector<pair<size_t, uint64_t>> decrypt_labeled_matches(vector<Ciphertext> &encrypted_matches);
     PublicKey& public_key();
+    // not needed if params.relin_free() is set.
     RelinKeys relin_keys();
+    // if params.seeded_keys() is set, the seeds that the public key and the
+    // relinearization keys that relin_keys() returned last are expanded from.
+    pair<uint64_t, uint64_t> public_key_seed();
+    pair<uint64_t, uint64_t> relin_keys_seed();
 
 private:
     PSIParams &params;
     KeyGenerator keygen;
     PublicKey public_key_;
     SecretKey secret_key;
+    vector<size_t> stash_;
+    size_t seed_retries_;
+    vector<pair<uint64_t, uint64_t>> query_seeds_;
+    pair<uint64_t, uint64_t> public_key_seed_;
+    pair<uint64_t, uint64_t> relin_keys_seed_;
+};
+
+/* PSISenderDB holds everything the sender can precompute before seeing any
+   query: the coefficients of the polynomials f (and g, for labeled PSI) of
+   every bucket of every partition, batched into plaintexts. it depends only on
+   the sender's set, the labels and the hash seeds, so it can be built once and
+   then used to answer any number of queries.
+
+   a DB can be saved to a file and mapped back into memory later, which skips
+   the hashing and interpolation entirely. the plaintexts of a mapped DB are
+   read straight from the page cache, so several processes that map the same
+   file share the same physical pages. */
+class PSISenderDB
+{
+public:
+    /* throws runtime_error if the set doesn't fit into the hash table with
+       params.seeds. if nobody has those seeds yet, the caller can pick new
+       ones and try again. */
+    PSISenderDB(PSIParams &params,
+                vector<uint64_t> &inputs,
+                optional<vector<uint64_t>> &labels);
+    /* maps a DB that was written with save(). `params` must be the result of
+       calling read_params on the same file. throws runtime_error if the file
+       can't be mapped, isn't a complete DB of this version, or doesn't match
+       `params`. */
+    PSISenderDB(PSIParams &params, const string &path);
+    ~PSISenderDB();
+
+    PSISenderDB(const PSISenderDB &) = delete;
+    PSISenderDB& operator=(const PSISenderDB &) = delete;
+
+    /* reads the parameters (including the hash seeds) that the DB stored in
+       the file at `path` was built with. throws runtime_error if the file
+       can't be read or isn't a DB of this version. */
+    static PSIParams read_params(const string &path);
+    void save(const string &path);
+
+    bool is_labeled();
+    bool is_ntt_form();
+    /* sets `destination` to the plaintext that contains the jth coefficient of
+       f for every bucket in `partition`. if the DB is in NTT form, so is this
+       plaintext, except for the constant coefficients (j = 0), which are
+       encrypted rather than multiplied and thus always in coefficient form. */
+    void f_coeffs(size_t partition, size_t j, Plaintext &destination);
+    /* same as f_coeffs, but for g. only available for labeled PSI. */
+    void g_coeffs(size_t partition, size_t j, Plaintext &destination);
+    /* the words of the plaintext that f_coeffs (or g_coeffs, if is_g is set)
+       would load, without copying them. for j > 0 in an NTT form DB, that's
+       one block of poly_modulus_degree() words per coeff_modulus prime. */
+    const uint64_t *coeffs_data(size_t partition, size_t j, bool is_g);
+
+    /* adds `input` (with `label`, for labeled PSI) to the set without
+       rebuilding the DB. the input goes into a random empty slot of each of
+       its buckets, and only those buckets' polynomials and the coefficient
+       plaintexts of their partitions are updated. returns false (and changes
+       nothing) if the input is already in the set, one of its buckets is
+       full, or there are already PACKED_SLOT_MAX_INPUTS inputs.
+       updates are only possible for DBs built in memory, not for mapped ones,
+       and must not run concurrently with queries. */
+    bool insert(uint64_t input, uint64_t label = 0);
+    /* removes `input` from the set without rebuilding the DB, by freeing its
+       slots (and its index, for a later insert to reuse). returns false if it
+       isn't in the set. */
+    bool remove(uint64_t input);
+
+private:
+    uint64_t *plaintext_data(size_t partition, size_t j, bool is_g);
+    void load_plaintext(size_t partition, size_t j, bool is_g, Plaintext &destination);
+    void store_plaintext(Plaintext &plain, size_t partition, size_t j, bool is_g, Evaluator &evaluator);
+    /* finds the slots holding `input`, one per hash function. */
+    bool find_slots(uint64_t input, vector<size_t> &slot_indices);
+    /* puts new_slots[i] into slot slot_indices[i] of the hash table for
+       each i, and patches the plaintexts of the buckets that changed. */
+    void update_slots(const vector<size_t> &slot_indices, const vector<packed_slot> &new_slots);
+    /* puts `new_slot` into the hash table and updates the polynomials of its
+       bucket in f_coeffs_ and g_coeffs_, but not the plaintexts. */
+    void update_slot(size_t slot_index, packed_slot new_slot);
+    /* loads the jth coefficient plaintext like load_plaintext, but always in
+       coefficient form, so that it can be patched. */
+    void load_coefficient_form(size_t partition, size_t j, bool is_g, Plaintext &destination);
+    /* the index of the jth coefficient of `bucket` in f_coeffs_ and g_coeffs_. */
+    size_t coefficient_index(size_t partition, size_t j, size_t bucket);
+
+    PSIParams &params;
+    bool labeled;
+    bool ntt_form;
+    // number of uint64_t words in each plaintext
+    size_t plaintext_size;
+    // the plaintexts of all partitions, stored back to back: for each
+    // partition, for each coefficient j, the plaintext for f followed by the
+    // one for g (if labeled). this either points into `owned_data` or into a
+    // read-only mapping of a DB file.
+    uint64_t *data;
+    vector<uint64_t> owned_data;
+    void *mapping;
+    size_t mapping_size;
+
+    // the set, its labels and the (capacity × bucket_count) hash table it
+    // was hashed into, which is row-major (see complete_hash), so that each
+    // partition's rows are contiguous. these are only kept for DBs built in
+    // memory.
+    vector<uint64_t> inputs_;
+    vector<uint64_t> labels_;
+    vector<packed_slot> buckets;
+    // indices into inputs_ (and labels_) that removed inputs left behind, for
+    // insert to reuse.
+    vector<size_t> free_inputs;
+    // the coefficients of f (and g) of every bucket, laid out like the slots
+    // of the plaintexts: the jth coefficients of all of a partition's buckets
+    // are contiguous. an update reads the old polynomials from here rather
+    // than decoding every plaintext of the partition.
+    vector<uint64_t> f_coeffs_;
+    vector<uint64_t> g_coeffs_;
+    shared_ptr<UniformRandomGenerator> random;
 };
 
 class PSISender
 {
 public:
     PSISender(PSIParams &params);
+    /* builds a throwaway PSISenderDB and answers a single query with it.
+       if params.relin_free() is set, relin_keys aren't used, and can be
+       empty. */
     vector<Ciphertext> compute_matches(vector<uint64_t> &inputs,
                                        optional<vector<uint64_t>> &labels,
                                        PublicKey& receiver_public_key,
                                        RelinKeys relin_keys,
                                        vector<Ciphertext> &receiver_inputs);
+    /* answers a query with a prebuilt DB. relin_keys are as above. */
+    vector<Ciphertext> compute_matches(PSISenderDB &db,
+                                       PublicKey& receiver_public_key,
+                                       RelinKeys relin_keys,
+                                       vector<Ciphertext> &receiver_inputs);
+    /* blocks until the mask pool is full (see PSIParams::set_mask_pool_size),
+       e.g. to make sure the first query doesn't have to make masks. */
+    void prepare_masks();
 
 private:
     PSIParams &params;
+    // null if params.mask_pool_size() is 0
+    unique_ptr<MaskPool> mask_pool;
 };
@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cstring>
 
 #include "random.h"
 
@@ -51,3 +52,105 @@ uint64_t random_nonzero_integer(shared_ptr<UniformRandomGenerator> random, uint6
 
     return result;
 }
+
+/* the number of bits needed to write limit - 1, so that rejection sampling
+   with that many bits succeeds with probability at least 1/2. */
+size_t rejection_bits(uint64_t limit) {
+    return (limit == 1) ? 0 : (64 - __builtin_clzll(limit - 1));
+}
+
+AESRandom::AESRandom(shared_ptr<UniformRandomGenerator> seed_source)
+    : AESRandom(random_bits(seed_source, 64), random_bits(seed_source, 64)) {}
+
+AESRandom::AESRandom(uint64_t key_high, uint64_t key_low) : counter(0) {
+    aes.set_key(key_high, key_low);
+    position = 2 * AES_RANDOM_BUFFER_BLOCKS;
+}
+
+void AESRandom::refill() {
+    for (size_t i = 0; i < AES_RANDOM_BUFFER_BLOCKS; i++) {
+        buffer[i] = _mm_set_epi64x(0, counter);
+        counter++;
+    }
+    aes.encrypt_blocks(buffer, buffer, AES_RANDOM_BUFFER_BLOCKS);
+    position = 0;
+}
+
+uint64_t AESRandom::next_word() {
+    if (position == 2 * AES_RANDOM_BUFFER_BLOCKS) {
+        refill();
+    }
+    uint64_t result;
+    memcpy(&result, ((uint64_t*) buffer) + position, sizeof(result));
+    position++;
+    return result;
+}
+
+uint64_t AESRandom::bits(size_t bits) {
+    assert((bits > 0) && (bits <= 64));
+    return next_word() >> (64 - bits);
+}
+
+uint64_t AESRandom::integer(uint64_t limit) {
+    assert(limit > 0);
+    size_t k = rejection_bits(limit);
+    if (k == 0) {
+        return 0;
+    }
+
+    uint64_t result;
+    do {
+        result = bits(k);
+    } while (result >= limit);
+
+    return result;
+}
+
+uint64_t AESRandom::nonzero_integer(uint64_t limit) {
+    assert(limit > 1);
+
+    uint64_t result;
+    do {
+        result = integer(limit);
+    } while (result == 0);
+
+    return result;
+}
+
+void AESRandom::fill_integers(uint64_t *destination, size_t count, uint64_t limit) {
+    assert(limit > 0);
+    size_t k = rejection_bits(limit);
+    uint64_t mask = (k == 64) ? ~0ull : ((1ull << k) - 1);
+
+    size_t i = 0;
+    if (k <= 32) {
+        // each word gives two candidates
+        while (i < count) {
+            uint64_t word = next_word();
+            uint64_t low = word & mask;
+            uint64_t high = (word >> 32) & mask;
+            if (low < limit) {
+                destination[i++] = low;
+            }
+            if ((high < limit) && (i < count)) {
+                destination[i++] = high;
+            }
+        }
+    } else {
+        while (i < count) {
+            uint64_t candidate = next_word() & mask;
+            if (candidate < limit) {
+                destination[i++] = candidate;
+            }
+        }
+    }
+}
+
+void AESRandom::fill_nonzero_integers(uint64_t *destination, size_t count, uint64_t limit) {
+    assert(limit > 1);
+    // pick x - 1 uniformly in [0, limit - 1)
+    fill_integers(destination, count, limit - 1);
+    for (size_t i = 0; i < count; i++) {
+        destination[i]++;
+    }
+}
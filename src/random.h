@@ -3,6 +3,8 @@
 
 #include "seal/seal.h"
 
+#include "aes.h"
+
 using namespace seal;
 using namespace std;
 
@@ -15,3 +17,44 @@ uint64_t random_integer(shared_ptr<UniformRandomGenerator> random, uint64_t limi
 
 /* This helper function uniformly picks an integer x with 0 < x < limit. */
 uint64_t random_nonzero_integer(shared_ptr<UniformRandomGenerator> random, uint64_t limit);
+
+// the number of AES blocks that AESRandom encrypts at a time
+const size_t AES_RANDOM_BUFFER_BLOCKS = 64;
+
+/* AESRandom is a pseudorandom generator that encrypts a counter with AES-128
+   (AES in counter mode). It is much faster than drawing values from a
+   UniformRandomGenerator one by one: the blocks are encrypted in batches with
+   AES::encrypt_blocks and buffered, and drawing a value doesn't go through a
+   virtual call.
+   The key is either drawn from a UniformRandomGenerator, or given explicitly
+   to expand a short seed into a long, reproducible stream.
+   Like UniformRandomGenerator, it is not thread-safe. */
+class AESRandom
+{
+public:
+    AESRandom(shared_ptr<UniformRandomGenerator> seed_source);
+    AESRandom(uint64_t key_high, uint64_t key_low);
+
+    /* returns a uniformly random n-bit value, 0 < n <= 64. */
+    uint64_t bits(size_t bits);
+    /* returns a uniformly random x with 0 <= x < limit. */
+    uint64_t integer(uint64_t limit);
+    /* returns a uniformly random x with 0 < x < limit. */
+    uint64_t nonzero_integer(uint64_t limit);
+    /* sets destination[0..count) to uniformly random x with
+       0 <= x < limit. */
+    void fill_integers(uint64_t *destination, size_t count, uint64_t limit);
+    /* sets destination[0..count) to uniformly random x with
+       0 < x < limit. */
+    void fill_nonzero_integers(uint64_t *destination, size_t count, uint64_t limit);
+
+private:
+    uint64_t next_word();
+    void refill();
+
+    AES aes;
+    uint64_t counter;
+    __m128i buffer[AES_RANDOM_BUFFER_BLOCKS];
+    // the number of 64-bit words of `buffer` that have been used
+    size_t position;
+};
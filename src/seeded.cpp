@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cassert>
+
+#include "seal/randomtostd.h"
+#include "seal/util/clipnormal.h"
+#include "seal/util/globals.h"
+#include "seal/util/ntt.h"
+#include "seal/util/polyarithsmallmod.h"
+
+#include "seeded.h"
+
+pair<uint64_t, uint64_t> random_seed(shared_ptr<UniformRandomGenerator> random)
+{
+    return pair<uint64_t, uint64_t>(random_bits(random, 64), random_bits(random, 64));
+}
+
+void expand_seeded_ciphertext(shared_ptr<SEALContext> context,
+                              pair<uint64_t, uint64_t> seed,
+                              Ciphertext &destination)
+{
+    auto context_data = context->first_context_data();
+    auto &coeff_modulus = context_data->parms().coeff_modulus();
+    size_t n = context_data->parms().poly_modulus_degree();
+
+    destination.resize(context, context_data->parms_id(), 2);
+    destination.is_ntt_form() = false;
+
+    // a is uniform mod every prime, and thus (by the CRT) mod their product.
+    AESRandom expander(seed.first, seed.second);
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+        expander.fill_integers(destination.data(1) + i * n, n, coeff_modulus[i].value());
+    }
+}
+
+void expand_key_ciphertext(shared_ptr<SEALContext> context, AESRandom &expander, Ciphertext &key)
+{
+    auto context_data = context->context_data(key.parms_id());
+    auto &coeff_modulus = context_data->parms().coeff_modulus();
+    size_t n = context_data->parms().poly_modulus_degree();
+    assert(key.is_ntt_form() && (key.size() == 2));
+
+    // uniform values are just as uniform in the NTT domain, so a' is
+    // expanded in NTT form directly.
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+        expander.fill_integers(key.data(1) + i * n, n, coeff_modulus[i].value());
+    }
+}
+
+void reseed_key_ciphertext(shared_ptr<SEALContext> context,
+                           const SecretKey &secret_key,
+                           AESRandom &expander,
+                           Ciphertext &key)
+{
+    auto context_data = context->context_data(key.parms_id());
+    auto &coeff_modulus = context_data->parms().coeff_modulus();
+    size_t n = context_data->parms().poly_modulus_degree();
+    assert(key.is_ntt_form() && (key.size() == 2));
+
+    // both the key and the secret key are in NTT form, so this is all
+    // pointwise.
+    vector<uint64_t> old_c1(key.data(1), key.data(1) + coeff_modulus.size() * n);
+    expand_key_ciphertext(context, expander, key);
+    const uint64_t *secret_key_ntt = secret_key.data().data();
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+        uint64_t *difference = old_c1.data() + i * n;
+        util::sub_poly_poly_coeffmod(difference, key.data(1) + i * n, n, coeff_modulus[i], difference);
+        util::dyadic_product_coeffmod(difference, secret_key_ntt + i * n, n, coeff_modulus[i], difference);
+        util::add_poly_poly_coeffmod(key.data(0) + i * n, difference, n, coeff_modulus[i], key.data(0) + i * n);
+    }
+}
+
+SeededEncryptor::SeededEncryptor(shared_ptr<SEALContext> context, const SecretKey &secret_key)
+    : context(context),
+      secret_key(secret_key),
+      evaluator(context)
+{
+    auto random_factory = UniformRandomGeneratorFactory::default_factory();
+    random = random_factory->create();
+}
+
+void SeededEncryptor::encrypt(const Plaintext &plain, Ciphertext &destination)
+{
+    auto context_data = context->first_context_data();
+    auto &coeff_modulus = context_data->parms().coeff_modulus();
+    size_t n = context_data->parms().poly_modulus_degree();
+
+    pair<uint64_t, uint64_t> seed = random_seed(random);
+    expand_seeded_ciphertext(context, seed, destination);
+
+    // the error is the same polynomial mod every prime, drawn the way SEAL
+    // draws it for public key encryption.
+    RandomToStandardAdapter engine(random);
+    util::ClippedNormalDistribution distribution(
+        0, util::global_variables::noise_standard_deviation, util::global_variables::noise_max_deviation);
+    vector<int64_t> error(n);
+    for (size_t k = 0; k < n; k++) {
+        error[k] = static_cast<int64_t>(distribution(engine));
+    }
+
+    // c0 = -a * s + e. the secret key is kept in NTT form, so a is
+    // multiplied with it in the NTT domain.
+    const uint64_t *secret_key_ntt = secret_key.data().data();
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+        uint64_t q = coeff_modulus[i].value();
+        auto &ntt_tables = context_data->small_ntt_tables()[i];
+        uint64_t *c0 = destination.data(0) + i * n;
+
+        copy_n(destination.data(1) + i * n, n, c0);
+        util::ntt_negacyclic_harvey(c0, ntt_tables);
+        util::dyadic_product_coeffmod(c0, secret_key_ntt + i * n, n, coeff_modulus[i], c0);
+        util::inverse_ntt_negacyclic_harvey(c0, ntt_tables);
+        util::negate_poly_coeffmod(c0, n, coeff_modulus[i], c0);
+        for (size_t k = 0; k < n; k++) {
+            uint64_t e = (error[k] >= 0) ? ((uint64_t) error[k]) : (q - (uint64_t) (-error[k]));
+            c0[k] += e;
+            c0[k] = (c0[k] >= q) ? (c0[k] - q) : c0[k];
+        }
+    }
+
+    // adds Δm to c0
+    evaluator.add_plain_inplace(destination, plain);
+    seeds_.push_back(seed);
+}
+
+vector<pair<uint64_t, uint64_t>> &SeededEncryptor::seeds()
+{
+    return seeds_;
+}
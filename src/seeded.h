@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "seal/seal.h"
+
+#include "random.h"
+
+using namespace std;
+using namespace seal;
+
+/*
+A seeded ciphertext is a fresh BFV encryption (c0, c1) = (-a * s + e + Δm, a)
+under the secret key s, whose uniformly random polynomial a is not sent, but
+expanded from a 128-bit seed with AESRandom. Only c0 and the seed go over the
+wire, which is half the size of a ciphertext encrypted with the public key.
+The error e is drawn from the usual source of randomness, so the seed reveals
+nothing but a.
+
+Seeded ciphertexts are only at the first parms_id of the context, and only
+fresh ones can be sent this way: any operation on them makes c1 depend on
+more than the seed.
+
+Public and relinearization keys are ciphertexts of the same shape (in NTT
+form), so they can be sent the same way. They aren't fresh encryptions, but
+the receiver, who knows s, can swap their random halves for ones expanded
+from a seed after the fact (see reseed_key_ciphertext). All the ciphertexts of
+a key are expanded from a single AESRandom stream, one after the other, so
+each key needs only one seed.
+*/
+
+/* draws a fresh seed. */
+pair<uint64_t, uint64_t> random_seed(shared_ptr<UniformRandomGenerator> random);
+
+/* sets `destination` to a ciphertext at the first parms_id whose c1 is
+   expanded from `seed`. c0 is left as is, to be filled in by the caller. */
+void expand_seeded_ciphertext(shared_ptr<SEALContext> context,
+                              pair<uint64_t, uint64_t> seed,
+                              Ciphertext &destination);
+
+/* sets c1 of `key`, a ciphertext of a public or relinearization key, to the
+   next polynomial that `expander` produces. c0 is left as is. */
+void expand_key_ciphertext(shared_ptr<SEALContext> context, AESRandom &expander, Ciphertext &key);
+
+/* sets c1 of `key` to the next polynomial a' that `expander` produces, and
+   c0 to c0 + (c1 - a') * s, so that c0 + c1 * s, and thus what the key
+   encrypts and its error, stay the same. */
+void reseed_key_ciphertext(shared_ptr<SEALContext> context,
+                           const SecretKey &secret_key,
+                           AESRandom &expander,
+                           Ciphertext &key);
+
+/* encrypts plaintexts under the secret key, with a fresh seed for every
+   ciphertext. like SEAL's Encryptor, it is not thread-safe. */
+class SeededEncryptor
+{
+public:
+    SeededEncryptor(shared_ptr<SEALContext> context, const SecretKey &secret_key);
+
+    void encrypt(const Plaintext &plain, Ciphertext &destination);
+    /* the seeds of all the ciphertexts encrypt has made so far, in order. */
+    vector<pair<uint64_t, uint64_t>> &seeds();
+
+private:
+    shared_ptr<SEALContext> context;
+    const SecretKey &secret_key;
+    Evaluator evaluator;
+    shared_ptr<UniformRandomGenerator> random;
+    vector<pair<uint64_t, uint64_t>> seeds_;
+};
@@ -1,5 +1,9 @@
 #include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 
 #include "boost/asio.hpp"
 
@@ -8,7 +12,7 @@
 using namespace std;
 using namespace boost::asio;
 
-int main()
+int main(int argc, char** argv)
 {
     vector<uint64_t> inputs = {0x01, 0x02, 0x03, 0x04, 0x07, 0x22, 0xca, 0xfe};
     vector<uint64_t> labels = {0x01, 0x01, 0x02, 0x03, 0x01, 0x02, 0x00, 0x03};
@@ -16,6 +20,67 @@ int main()
     size_t poly_modulus_degree = 8192;
     unsigned short port = 9999;
 
+    // if a path to a preprocessed DB is given and the file exists, we map it
+    // and start answering queries right away. otherwise we preprocess the set
+    // (and save the result to that path, if one is given).
+    string db_path = (argc > 1) ? argv[1] : "";
+    bool db_exists = !db_path.empty() && ifstream(db_path).good();
+    // in relin-free mode, the receiver sends all the powers of its input that
+    // we need, instead of relinearization keys.
+    bool relin_free = (argc > 2) && (atol(argv[2]) != 0);
+    // the wire formats we accept and use (see networking.h). they are all
+    // off by default, so that older receivers can still talk to us.
+    bool seeded_queries = (argc > 3) && (atol(argv[3]) != 0);
+    bool seeded_keys = (argc > 4) && (atol(argv[4]) != 0);
+    bool packed_ciphertexts = (argc > 5) && (atol(argv[5]) != 0);
+    uint32_t mode = (relin_free ? NET_MODE_RELIN_FREE : 0)
+                    | (seeded_queries ? NET_MODE_SEEDED_QUERIES : 0)
+                    | (seeded_keys ? NET_MODE_SEEDED_KEYS : 0)
+                    | (packed_ciphertexts ? NET_MODE_PACKED_CIPHERTEXTS : 0);
+
+    // the sender picks the hash seeds for its set once, so that it only has to
+    // hash its set and interpolate the bucket polynomials once, at load time,
+    // instead of once per query. the receiver's set size does not affect any
+    // of that, so we fill it in separately for every connection.
+    PSIParams params(0, inputs.size(), input_bits, poly_modulus_degree);
+    unique_ptr<PSISenderDB> sender_db;
+    if (db_exists) {
+        cout << "mapping preprocessed set from " << db_path << endl;
+        try {
+            params = PSISenderDB::read_params(db_path);
+            sender_db = make_unique<PSISenderDB>(params, db_path);
+        } catch (const runtime_error &error) {
+            cout << "can't load " << db_path << ": " << error.what() << endl;
+            return 1;
+        }
+    } else {
+        cout << "preprocessing the set" << endl;
+        optional<vector<uint64_t>> labels_opt = labels;
+        // no receiver has seen our seeds yet, so if the set doesn't fit with
+        // them, we can just pick others.
+        while (!sender_db) {
+            params.generate_seeds();
+            try {
+                sender_db = make_unique<PSISenderDB>(params, inputs, labels_opt);
+            } catch (const runtime_error &error) {
+                cout << error.what() << ", picking new seeds" << endl;
+            }
+        }
+        if (!db_path.empty()) {
+            cout << "saving preprocessed set to " << db_path << endl;
+            sender_db->save(db_path);
+        }
+    }
+    try {
+        params.set_relin_free(relin_free);
+    } catch (const runtime_error &error) {
+        cout << "can't serve this set in relin-free mode: " << error.what() << endl;
+        return 1;
+    }
+    // masks for one (labeled) query are made while we wait for it
+    params.set_mask_pool_size(2 * params.sender_partition_count());
+    PSISender sender(params);
+
     io_context context;
     ip::tcp::acceptor acceptor(context);
     ip::tcp::endpoint endpoint(ip::tcp::v4(), port);
@@ -24,52 +89,70 @@ int main()
     acceptor.bind(endpoint);
     acceptor.listen();
 
-    cout << "listening" << endl;
+    while (true) {
+        cout << "listening" << endl;
 
-    ip::tcp::socket socket(context);
-    acceptor.accept(socket);
-    Networking net(socket);
+        ip::tcp::socket socket(context);
+        acceptor.accept(socket);
+        // a receiver that sends something invalid or hangs up only loses its
+        // own connection.
+        try {
+            Networking net(socket);
+            net.set_seal_context(params.context);
+            net.set_packed_polynomials(packed_ciphertexts);
 
-    cout << "accepted, sending hello and set size" << endl;
-    net.write_hello();
-    net.write_uint32(inputs.size());
+            cout << "accepted, sending hello, set size, seeds, mode and query params" << endl;
+            net.write_hello();
+            net.write_uint32(params.sender_size);
+            net.write_uint64s(params.seeds);
+            net.write_uint32(mode);
+            // the receiver needs these to make the query that our DB was
+            // built for, and a preprocessed DB may not use the defaults.
+            net.write_uint32(params.sender_partition_count());
+            net.write_uint32(params.window_size());
+            net.write_uint32(params.ps_low_degree());
+            net.write_uint32(params.query_depth());
 
-    cout << "waiting for hello" << endl;
-    net.read_hello();
-    cout << "waiting for set size" << endl;
-    size_t receiver_size = net.read_uint32();
-    cout << "waiting for seeds" << endl;
-    vector<uint64_t> seeds;
-    net.read_uint64s(seeds);
+            cout << "waiting for hello" << endl;
+            net.read_hello();
+            cout << "waiting for set size" << endl;
+            size_t receiver_size = net.read_uint32();
+            // the receiver must be able to cuckoo hash its set into the buckets
+            if (receiver_size > (1ull << params.bucket_count_log())) {
+                throw runtime_error("the receiver's set is too large");
+            }
+            params.receiver_size = receiver_size;
 
-    // we can now establish the PSI parameters, which creates the SEAL context,
-    // which we need to receive keys and ciphertexts
-    PSIParams params(receiver_size, inputs.size(), input_bits, poly_modulus_degree);
-    params.set_seeds(seeds);
-    net.set_seal_context(params.context);
+            cout << "waiting for public key" << endl;
+            PublicKey receiver_pk;
+            net.read_public_key(receiver_pk);
+            RelinKeys receiver_rk;
+            if (!relin_free) {
+                cout << "waiting for relin keys" << endl;
+                net.read_relin_keys(receiver_rk);
+            }
+            cout << "waiting for inputs" << endl;
+            vector<Ciphertext> receiver_inputs;
+            net.read_ciphertexts(receiver_inputs);
 
-    cout << "waiting for public key" << endl;
-    PublicKey receiver_pk;
-    net.read_public_key(receiver_pk);
-    cout << "waiting for relin keys" << endl;
-    RelinKeys receiver_rk;
-    net.read_relin_keys(receiver_rk);
-    cout << "waiting for inputs" << endl;
-    vector<Ciphertext> receiver_inputs;
-    net.read_ciphertexts(receiver_inputs);
-
-    cout << "computing matches" << endl;
-
-    PSISender sender(params);
-    optional<vector<uint64_t>> labels_opt = labels;
-    auto sender_matches = sender.compute_matches(
-        inputs,
-        labels_opt,
-        receiver_pk,
-        receiver_rk,
-        receiver_inputs
-    );
+            cout << "computing matches" << endl;
+            auto sender_matches = sender.compute_matches(
+                *sender_db,
+                receiver_pk,
+                receiver_rk,
+                receiver_inputs
+            );
 
-    cout << "sending matches" << endl;
-    net.write_ciphertexts(sender_matches);
+            cout << "sending matches" << endl;
+            if (packed_ciphertexts) {
+                net.write_packed_ciphertexts(sender_matches);
+            } else {
+                net.write_ciphertexts(sender_matches);
+            }
+        } catch (const exception &error) {
+            cout << "dropping connection: " << error.what() << endl;
+            boost::system::error_code ignored;
+            socket.close(ignored);
+        }
+    }
 }
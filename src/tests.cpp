@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "hashing.h"
+#include "psi.h"
+#include "random.h"
+#include "test_utils.h"
+
+using namespace std;
+
+// unlike assert, this still checks in release builds.
+#define CHECK(condition)                                                     \
+    if (!(condition)) {                                                      \
+        cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition \
+             << endl;                                                        \
+        exit(1);                                                             \
+    }
+
+// with 3 hash functions, a cuckoo hash table can only be filled to about 92%,
+// so filling every bucket has to run out of evictions.
+void test_cuckoo_hash_full_table(shared_ptr<UniformRandomGenerator> random)
+{
+    size_t m = 10;
+    vector<uint64_t> inputs(1ull << m);
+    generate_random_sender_set(random, inputs, 32);
+
+    vector<uint64_t> seeds(3);
+    for (size_t i = 0; i < seeds.size(); i++) {
+        seeds[i] = random_bits(random, 64);
+    }
+
+    vector<bucket_slot> buckets;
+    vector<size_t> stash;
+    CHECK(!cuckoo_hash(random, inputs, m, buckets, seeds, stash, 0));
+    CHECK(stash.empty());
+
+    // with a large enough stash, every input ends up somewhere.
+    CHECK(cuckoo_hash(random, inputs, m, buckets, seeds, stash, inputs.size()));
+    CHECK(!stash.empty());
+    size_t placed = stash.size();
+    for (auto &slot : buckets) {
+        if (slot != BUCKET_EMPTY) {
+            placed++;
+        }
+    }
+    CHECK(placed == inputs.size());
+}
+
+// the receiver can't drop inputs silently when the table is full and it isn't
+// allowed to pick other seeds.
+void test_encrypt_inputs_full_table(shared_ptr<UniformRandomGenerator> random)
+{
+    size_t poly_modulus_degree = 8192;
+    vector<uint64_t> sender_inputs(poly_modulus_degree);
+    vector<uint64_t> receiver_inputs(poly_modulus_degree);
+    generate_random_sender_set(random, sender_inputs, 32);
+    generate_random_sender_set(random, receiver_inputs, 32);
+
+    PSIParams params(receiver_inputs.size(), sender_inputs.size(), 32, poly_modulus_degree);
+    params.generate_seeds();
+    params.set_receiver_seed_retry(false);
+
+    PSIReceiver user(params);
+    vector<bucket_slot> buckets;
+    bool threw = false;
+    try {
+        user.encrypt_inputs(receiver_inputs, buckets);
+    } catch (runtime_error &e) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+// updating a DB in place has to give the same polynomials as building it from
+// the updated set: an insertion that is undone leaves every plaintext exactly
+// as it was, and a patched DB answers queries like a freshly built one.
+void test_sender_db_updates(shared_ptr<UniformRandomGenerator> random, bool ntt_evaluation)
+{
+    size_t input_bits = 32;
+    size_t poly_modulus_degree = 8192;
+    vector<uint64_t> sender_inputs(1001);
+    vector<uint64_t> sender_labels(sender_inputs.size());
+    generate_random_sender_set(random, sender_inputs, input_bits);
+    generate_random_labels(random, sender_labels, input_bits);
+    // the last input isn't in the set at first, and gets inserted later
+    uint64_t inserted = sender_inputs.back();
+    uint64_t inserted_label = sender_labels.back();
+    sender_inputs.pop_back();
+    sender_labels.pop_back();
+    uint64_t removed = sender_inputs[0];
+
+    PSIParams params(64, sender_inputs.size(), input_bits, poly_modulus_degree);
+    params.set_ntt_evaluation(ntt_evaluation);
+    params.generate_seeds();
+    optional<vector<uint64_t>> labels = sender_labels;
+    PSISenderDB db(params, sender_inputs, labels);
+
+    // every coefficient plaintext, as the constructor made it
+    auto plaintexts = [&](PSISenderDB &db) {
+        vector<uint64_t> words;
+        size_t plaintext_size = ntt_evaluation
+                                ? params.poly_modulus_degree() * params.context->first_context_data()->parms().coeff_modulus().size()
+                                : params.poly_modulus_degree();
+        for (size_t partition = 0; partition < params.sender_partition_count(); partition++) {
+            size_t partition_start, partition_size;
+            params.sender_partition_rows(partition, partition_start, partition_size);
+            for (size_t j = 0; j < partition_size + 1; j++) {
+                for (bool is_g : {false, true}) {
+                    size_t size = (j > 0) ? plaintext_size : params.poly_modulus_degree();
+                    const uint64_t *data = db.coeffs_data(partition, j, is_g);
+                    words.insert(words.end(), data, data + size);
+                }
+            }
+        }
+        return words;
+    };
+    vector<uint64_t> built = plaintexts(db);
+    CHECK(db.insert(inserted, inserted_label));
+    CHECK(plaintexts(db) != built);
+    CHECK(db.remove(inserted));
+    CHECK(plaintexts(db) == built);
+
+    CHECK(db.insert(inserted, inserted_label));
+    CHECK(db.remove(removed));
+    vector<uint64_t> updated_inputs(sender_inputs.begin() + 1, sender_inputs.end());
+    vector<uint64_t> updated_labels(sender_labels.begin() + 1, sender_labels.end());
+    updated_inputs.push_back(inserted);
+    updated_labels.push_back(inserted_label);
+    optional<vector<uint64_t>> updated_labels_opt = updated_labels;
+    PSISenderDB fresh_db(params, updated_inputs, updated_labels_opt);
+
+    // a query for the inserted input, the removed one, a few others from
+    // the set, and a few that were never in it
+    vector<uint64_t> receiver_inputs(params.receiver_size);
+    vector<uint64_t> untouched_inputs(updated_inputs.begin(), updated_inputs.end() - 1);
+    generate_random_receiver_set(random, receiver_inputs, untouched_inputs, input_bits, 8);
+    receiver_inputs[0] = inserted;
+    receiver_inputs[1] = removed;
+
+    PSIReceiver user(params);
+    vector<bucket_slot> buckets;
+    auto encrypted_inputs = user.encrypt_inputs(receiver_inputs, buckets);
+    PSISender sender(params);
+    RelinKeys relin_keys = user.relin_keys();
+    auto encrypted_matches = sender.compute_matches(db, user.public_key(), relin_keys, encrypted_inputs);
+    auto fresh_encrypted_matches = sender.compute_matches(fresh_db, user.public_key(), relin_keys, encrypted_inputs);
+    auto matches = user.decrypt_labeled_matches(encrypted_matches);
+    auto fresh_matches = user.decrypt_labeled_matches(fresh_encrypted_matches);
+    sort(matches.begin(), matches.end());
+    sort(fresh_matches.begin(), fresh_matches.end());
+    CHECK(matches == fresh_matches);
+
+    bool found_inserted = false;
+    for (auto &match : matches) {
+        uint64_t input = receiver_inputs[buckets[match.first].first];
+        CHECK(input != removed);
+        if (input == inserted) {
+            CHECK(match.second == inserted_label);
+            found_inserted = true;
+        }
+    }
+    CHECK(found_inserted);
+}
+
+int main()
+{
+    auto random_factory = UniformRandomGeneratorFactory::default_factory();
+    auto random = random_factory->create();
+
+    test_cuckoo_hash_full_table(random);
+    test_encrypt_inputs_full_table(random);
+    test_sender_db_updates(random, false);
+    test_sender_db_updates(random, true);
+
+    cout << "all tests passed" << endl;
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include "threads.h"
+
+void run_workers(size_t thread_count, function<void(size_t)> worker)
+{
+    // an exception must not escape a thread (or leave the others unjoined),
+    // so every worker catches its own, and we rethrow one of them once all
+    // of them are done.
+    vector<exception_ptr> errors(thread_count);
+    auto run = [&](size_t t) {
+        try {
+            worker(t);
+        } catch (...) {
+            errors[t] = current_exception();
+        }
+    };
+
+    vector<thread> threads;
+    for (size_t t = 1; t < thread_count; t++) {
+        threads.emplace_back(run, t);
+    }
+    run(0);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (auto &error : errors) {
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+}
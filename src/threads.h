@@ -0,0 +1,10 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+
+using namespace std;
+
+/* runs worker(0), worker(1), ..., worker(thread_count - 1) concurrently, using
+   the calling thread as worker 0, and waits for all of them to finish. if any
+   of them throws, one of the exceptions is rethrown after that. */
+void run_workers(size_t thread_count, function<void(size_t)> worker);
@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cassert>
+#include <stdexcept>
 
 #include "polynomials.h"
+#include "threads.h"
 
 #include "windowing.h"
 
@@ -8,120 +11,256 @@
 // - figure out if there are any off-by-one errors that cause us to output more
 //   powers than necessary
 // - figure out if it's worth outputting fewer powers in the last window
-// - optimize the early exits in compute_powers
 
 Windowing::Windowing(size_t window_size, size_t max_power)
-    : window_size(window_size), max_power(max_power)
 {
-    if (window_size > 0) {
-        // TODO: evaluate if the performance benefit of adding one extra element
-        // to each window (and using bit shifts to index into arrays) is worth
-        // the memory/communication overhead.
-        window_width = (1ull << window_size) - 1;
-        window_count = 1;
-        // `window_count` is the first `i` such that
-        // `i > floor(log2(max_power + 1) / window_size)`
-        while ((1ull << (window_count * window_size)) <= max_power) {
-            window_count++;
+    if (window_size == 0) {
+        source_powers_.push_back(1);
+        return;
+    }
+
+    // TODO: evaluate if the performance benefit of adding one extra element
+    // to each window (and using bit shifts to index into arrays) is worth
+    // the memory/communication overhead.
+    size_t window_width = (1ull << window_size) - 1;
+    size_t window_count = 1;
+    // `window_count` is the first `i` such that
+    // `i > floor(log2(max_power + 1) / window_size)`
+    while ((1ull << (window_count * window_size)) <= max_power) {
+        window_count++;
+    }
+
+    // window i * window_width + j - 1 is y^{2^{l * i} * j}
+    for (size_t i = 0; i < window_count; i++) {
+        for (size_t j = 1; j <= window_width; j++) {
+            source_powers_.push_back(j << (window_size * i));
         }
     }
 }
 
+Windowing::Windowing(const vector<size_t> &source_powers)
+    : source_powers_(source_powers)
+{
+    assert(find(source_powers_.begin(), source_powers_.end(), 1) != source_powers_.end());
+}
+
+const vector<size_t> &Windowing::source_powers()
+{
+    return source_powers_;
+}
+
 void Windowing::prepare(vector<uint64_t> &input,
                         vector<Ciphertext> &windows,
                         uint64_t modulus,
                         BatchEncoder &encoder,
-                        Encryptor &encryptor)
+                        function<void(const Plaintext &, Ciphertext &)> encrypt)
 {
     Plaintext encoded;
+    vector<uint64_t> input_pow(input.size());
+    windows.resize(source_powers_.size());
 
-    if (window_size == 0) {
-        windows.resize(1);
-        encoder.encode(input, encoded);
-        encryptor.encrypt(encoded, windows[0]);
-        return;
+    for (size_t i = 0; i < source_powers_.size(); i++) {
+        with_modulus(modulus, [&](auto fixed) {
+            for (size_t k = 0; k < input.size(); k++) {
+                input_pow[k] = fixed.pow(input[k], source_powers_[i]);
+            }
+        });
+        encoder.encode(input_pow, encoded);
+        encrypt(encoded, windows[i]);
     }
+}
 
-    windows.resize(window_width * window_count);
+// marks powers that aren't one of the windows
+const size_t NO_WINDOW = (size_t) -1;
 
-    vector<uint64_t> input_mul;
-    for (size_t i = 0; i < window_count; i++) {
-        // throughout this loop, we maintain the following invariant
-        // (where y denotes the initial input):
-        // input = y^{2^{l * i}}
-        // input_mul = y^{2^{l * i} * j}
-        input_mul = input;
-        for (size_t j = 1; j <= window_width; j++) {
-            encoder.encode(input_mul, encoded);
-            encryptor.encrypt(
-                encoded,
-                windows[i * window_width + j - 1]
-            );
-
-            if (j <= window_width - 1) {
-                // multiply input_mul by input for next iteration.
-                for (size_t k = 0; k < input.size(); k++) {
-                    input_mul[k] = MUL_MOD(input_mul[k], input[k], modulus);
-                }
+/* plans how to compute y^1, ..., y^n (n = window_of.size() - 1) with the least
+   multiplicative depth, given the powers that the windows hold: y^k is
+   windows[window_of[k]] if window_of[k] != NO_WINDOW, and otherwise
+   y^factors[k] * y^(k - factors[k]). levels[d] lists the powers of depth
+   d + 1, each of which only depends on powers of lower depth.
+   the depth of y^k is the lowest max(depth(y^a), depth(y^(k - a))) + 1 over
+   all a, so we find it for every k in increasing order. among the best splits,
+   we pick the most balanced one, which is a square when possible. */
+void plan_powers(vector<size_t> &window_of, vector<size_t> &factors, vector<vector<size_t>> &levels)
+{
+    size_t n = window_of.size() - 1;
+    vector<size_t> depth(n + 1, 0);
+    factors.assign(n + 1, 0);
+    levels.clear();
+
+    for (size_t k = 1; k <= n; k++) {
+        if (window_of[k] != NO_WINDOW) {
+            continue;
+        }
+        // y^1 is always a window, so there is at least one split
+        assert(k >= 2);
+        for (size_t a = k / 2; a >= 1; a--) {
+            size_t new_depth = max(depth[a], depth[k - a]) + 1;
+            if ((factors[k] == 0) || (new_depth < depth[k])) {
+                factors[k] = a;
+                depth[k] = new_depth;
             }
         }
+        if (levels.size() < depth[k]) {
+            levels.resize(depth[k]);
+        }
+        levels[depth[k] - 1].push_back(k);
+    }
+}
 
-        if (i < window_count - 1) {
-            // take input to the 2^l power for next iteration.
-            for (size_t k = 0; k < input.size(); k++) {
-                input[k] = modexp(input[k], 1ull << window_size, modulus);
+/* sets terms[k] to the fewest sources that y^k is the product of, for
+   k <= max_power. y^k can be computed from the sources with depth d if and
+   only if that's at most 2^d: a product of t values can be computed as a
+   balanced tree of depth ceil(log2(t)), and a tree of depth d has at most 2^d
+   leaves. this is the coin change problem. */
+void count_terms(vector<size_t> &sources, size_t max_power, vector<size_t> &terms)
+{
+    terms.assign(max_power + 1, NO_WINDOW);
+    terms[0] = 0;
+    for (size_t k = 1; k <= max_power; k++) {
+        for (size_t source : sources) {
+            if ((source <= k) && (terms[k - source] + 1 < terms[k])) {
+                terms[k] = terms[k - source] + 1;
             }
         }
     }
 }
 
-void Windowing::compute_powers(vector<Ciphertext> &windows,
-                               vector<Ciphertext> &powers,
-                               Evaluator &evaluator,
-                               RelinKeys &relin_keys)
+/* the largest n such that y^1, ..., y^n are products of at most max_terms
+   sources, if `terms` is what count_terms gives for the sources plus
+   `new_source`. a product that uses the new source j times is that source
+   times one that uses it j - 1 times, so this takes O(n) instead of
+   recounting everything. new_terms is scratch space. */
+size_t covered_powers(vector<size_t> &terms,
+                      size_t new_source,
+                      size_t max_terms,
+                      vector<size_t> &new_terms)
 {
-    if (window_size == 0) {
-        assert(windows.size() == 1);
-        powers[1] = windows[0];
-        for (size_t i = 2; i < powers.size(); i++) {
-            if (i & 2 == 0) {
-                evaluator.square(powers[i >> 1], powers[i]);
-            } else {
-                evaluator.multiply(powers[i - 1], powers[1], powers[i]);
-            }
-            evaluator.relinearize_inplace(powers[i], relin_keys);
+    size_t max_power = terms.size() - 1;
+    new_terms.resize(max_power + 1);
+    new_terms[0] = 0;
+    for (size_t k = 1; k <= max_power; k++) {
+        new_terms[k] = terms[k];
+        if ((new_source <= k) && (new_terms[k - new_source] + 1 < new_terms[k])) {
+            new_terms[k] = new_terms[k - new_source] + 1;
         }
-    } else {
-        assert(windows.size() == window_width * window_count);
-        // the first 2^l - 1 powers are directly copied over
-        for (size_t i = 1; i <= window_width; i++) {
-            if (i >= powers.size()) {
-                return;
+        if (new_terms[k] > max_terms) {
+            return k - 1;
+        }
+    }
+    return max_power;
+}
+
+vector<size_t> Windowing::sparse_powers(size_t max_power, size_t max_depth)
+{
+    assert(max_power > 0);
+    vector<size_t> sources = {1};
+    // with this many terms, y alone is enough
+    if ((max_depth >= 63) || ((1ull << max_depth) >= max_power)) {
+        return sources;
+    }
+    size_t max_terms = (1ull << max_depth);
+
+    // add sources greedily: the first power that isn't covered yet must be
+    // the product of at most max_terms sources, so the next source is at most
+    // that power. we pick the one that covers the most powers.
+    vector<size_t> terms, new_terms;
+    count_terms(sources, max_power, terms);
+    size_t covered = covered_powers(terms, 1, max_terms, new_terms);
+    while (covered < max_power) {
+        size_t best_source = covered + 1;
+        size_t best_covered = covered + 1;
+        for (size_t candidate = covered + 1; candidate >= 2; candidate--) {
+            size_t candidate_covered = covered_powers(terms, candidate, max_terms, new_terms);
+            if (candidate_covered > best_covered) {
+                best_source = candidate;
+                best_covered = candidate_covered;
             }
-            powers[i] = windows[i - 1];
         }
+        sources.push_back(best_source);
+        count_terms(sources, max_power, terms);
+        covered = best_covered;
+    }
 
-        for (size_t i = 1; i < window_count; i++) {
-            for (size_t j = 1; j <= window_width; j++) {
-                // now, for each new window i, we go over all of its elements
-                // j (encoding y^{2^{l * i} * j}) and compute every power of the
-                // form y^{2^{l * i} * j + k}, where k < 2^{l * i} (equivalently,
-                // y^k was computed before we started working on window i).
-                size_t high_bits = (j << (window_size * i));
-                if (high_bits >= powers.size()) {
-                    break;
-                }
-                powers[high_bits] = windows[i * window_width + j - 1];
-                for (size_t low_bits = 1; low_bits < (1ull << (window_size * i)); low_bits++) {
-                    size_t new_power = high_bits | low_bits;
-                    if (new_power >= powers.size()) {
-                        // TODO: figure out if there's a smarter way to break here.
-                        break;
-                    }
-                    evaluator.multiply(powers[low_bits], powers[high_bits], powers[new_power]);
-                    evaluator.relinearize_inplace(powers[new_power], relin_keys);
+    // a source picked early might not be needed anymore because of the
+    // sources picked after it.
+    for (size_t i = sources.size() - 1; i >= 1; i--) {
+        size_t source = sources[i];
+        sources.erase(sources.begin() + i);
+        count_terms(sources, max_power, terms);
+        if (covered_powers(terms, 1, max_terms, new_terms) < max_power) {
+            sources.insert(sources.begin() + i, source);
+        }
+    }
+
+    sort(sources.begin(), sources.end());
+    return sources;
+}
+
+void Windowing::plan(size_t max_power,
+                     vector<size_t> &window_of,
+                     vector<size_t> &factors,
+                     vector<vector<size_t>> &levels)
+{
+    // sources that are higher than the highest power we need are ignored.
+    window_of.assign(max_power + 1, NO_WINDOW);
+    for (size_t i = 0; i < source_powers_.size(); i++) {
+        if (source_powers_[i] <= max_power) {
+            window_of[source_powers_[i]] = i;
+        }
+    }
+    plan_powers(window_of, factors, levels);
+}
+
+size_t Windowing::depth(size_t max_power)
+{
+    vector<size_t> window_of, factors;
+    vector<vector<size_t>> levels;
+    plan(max_power, window_of, factors, levels);
+    return levels.size();
+}
+
+void Windowing::compute_powers(vector<Ciphertext> &windows,
+                               vector<Ciphertext> &powers,
+                               shared_ptr<SEALContext> context,
+                               RelinKeys &relin_keys,
+                               size_t thread_count)
+{
+    // the windows come from the receiver, who might not have sent as many
+    // as we expect.
+    if (windows.size() != source_powers_.size()) {
+        throw runtime_error("got the wrong number of query ciphertexts");
+    }
+    if (powers.size() < 2) {
+        return;
+    }
+
+    vector<size_t> window_of, factors;
+    vector<vector<size_t>> levels;
+    plan(powers.size() - 1, window_of, factors, levels);
+
+    for (size_t k = 1; k < powers.size(); k++) {
+        if (window_of[k] != NO_WINDOW) {
+            powers[k] = windows[window_of[k]];
+        }
+    }
+
+    // the products of a level are independent of each other, so they are
+    // split between the threads, and each thread writes to its own powers.
+    for (auto &level : levels) {
+        size_t level_thread_count = max<size_t>(1, min(thread_count, level.size()));
+        run_workers(level_thread_count, [&](size_t thread_index) {
+            Evaluator evaluator(context);
+            for (size_t i = thread_index; i < level.size(); i += level_thread_count) {
+                size_t k = level[i];
+                size_t a = factors[k];
+                if (2 * a == k) {
+                    evaluator.square(powers[a], powers[k]);
+                } else {
+                    evaluator.multiply(powers[a], powers[k - a], powers[k]);
                 }
+                evaluator.relinearize_inplace(powers[k], relin_keys);
             }
-        }
+        });
     }
 }
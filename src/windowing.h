@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
 #include <vector>
 
 #include "seal/seal.h"
@@ -24,27 +25,62 @@ over the values y^{2^{l * i} * j} for each 0 <= i <= ceil(log2(m) / l) and
 
 Additionally, we implement the special case l = 0 that does not use windowing
 and only sends over y.
+
+More generally, A can send any set of "source" powers of y that contains y
+itself, and B computes the others with the least possible multiplicative depth.
+sparse_powers picks a small such set for which that depth stays within a given
+budget: sending fewer powers makes the query smaller, but B has to compute more
+of them, so the budget trades upload size against B's multiplications and
+noise budget.
 */
 
 class Windowing
 {
 public:
     Windowing(size_t window_size, size_t max_power);
-    /* NB: prepare will overwrite the input. */
+    /* A sends y^source_powers[0], y^source_powers[1], ..., which must include
+       y^1. */
+    Windowing(const vector<size_t> &source_powers);
+
+    /* a small set of source powers from which all powers up to max_power can
+       be computed with multiplicative depth at most max_depth. it's found
+       greedily, by repeatedly adding the source that makes the longest run of
+       powers computable, and then dropping the sources that turn out to be
+       unnecessary. */
+    static vector<size_t> sparse_powers(size_t max_power, size_t max_depth);
+
+    /* the powers that A sends, in the order of the windows. */
+    const vector<size_t> &source_powers();
+    /* the multiplicative depth of the powers up to max_power that
+       compute_powers computes. */
+    size_t depth(size_t max_power);
+
+    /* sets windows[i] to y^source_powers()[i], encrypted with
+       encrypt(plaintext, destination), which can use a SEAL Encryptor or a
+       SeededEncryptor. */
     void prepare(vector<uint64_t> &input,
                  vector<Ciphertext> &windows,
                  uint64_t modulus,
                  BatchEncoder &encoder,
-                 Encryptor &encryptor);
-    /* NB: compute_powers leaves powers[0] untouched. */
+                 function<void(const Plaintext &, Ciphertext &)> encrypt);
+    /* computes powers[k] = y^k for 0 < k < powers.size() from the windows,
+       with the least possible multiplicative depth. the products that have
+       the same depth are computed in parallel on `thread_count` threads.
+       throws runtime_error if there isn't one window per source power.
+       NB: compute_powers leaves powers[0] untouched. */
     void compute_powers(vector<Ciphertext> &windows,
                         vector<Ciphertext> &powers,
-                        Evaluator &evaluator,
-                        RelinKeys &relin_keys);
+                        shared_ptr<SEALContext> context,
+                        RelinKeys &relin_keys,
+                        size_t thread_count = 1);
 
 private:
-    size_t window_size;
-    size_t max_power;
-    size_t window_width;
-    size_t window_count;
+    /* plans the computation of the powers up to max_power with plan_powers
+       (see windowing.cpp). */
+    void plan(size_t max_power,
+              vector<size_t> &window_of,
+              vector<size_t> &factors,
+              vector<vector<size_t>> &levels);
+
+    vector<size_t> source_powers_;
 };